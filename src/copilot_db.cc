@@ -5,18 +5,152 @@
 #include <rime/resource.h>
 #include <algorithm>
 #include <boost/algorithm/string.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace rime {
 
 // const string kCopilotFormat = "Rime::Copilot/1.0";
 // const string kCopilotFormatPrefix = "Rime::Copilot/";
-const string kCopilotFormat = "Rime::Predict/1.0";
+const string kCopilotFormat = "Rime::Predict/1.1";
 const string kCopilotFormatPrefix = "Rime::Predict/";
+const double kStatsFormatVersion = 1.1;
+
+copilot::WarmUp copilot::ParseWarmUp(const string& name) {
+  if (name == "willneed") return WarmUp::kWillNeed;
+  if (name == "touch") return WarmUp::kTouch;
+  if (name == "hugepage") return WarmUp::kHugePage;
+  if (!name.empty() && name != "none") {
+    LOG(WARNING) << "unknown copilot db warm-up: " << name;
+  }
+  return WarmUp::kNone;
+}
+
+CopilotDb::~CopilotDb() { StopWarmUp(); }
+
+void CopilotDb::StopWarmUp() {
+  stop_warm_up_ = true;
+  if (warm_up_thread_.joinable()) {
+    warm_up_thread_.join();
+  }
+  stop_warm_up_ = false;
+#if defined(__linux__)
+  if (char* pending = pending_image_.exchange(nullptr)) {
+    munmap(pending, image_size_);
+  }
+  if (image_) {
+    munmap(image_, image_size_);
+  }
+#endif
+  image_ = nullptr;
+  image_size_ = 0;
+}
+
+void CopilotDb::Prefetch() {
+  char* base = address();
+  size_t size = capacity();
+#if defined(__linux__) || defined(__APPLE__)
+  if (warm_up_ == copilot::WarmUp::kNone || !base || size == 0) {
+    return;
+  }
+  const size_t page = sysconf(_SC_PAGESIZE);
+#if defined(__linux__)
+  if (warm_up_ == copilot::WarmUp::kHugePage) {
+    // 复制整个文件较慢，不在 Load（IME 线程）中进行：先直接用 mmap，
+    // 后台复制完成后由 Lookup 切换到副本
+    warm_up_thread_ = std::thread([this, base, size] {
+      auto start = std::chrono::steady_clock::now();
+      // 按 2MB 对齐申请，便于内核用大页支撑
+      constexpr size_t kHugePage = 2 << 20;
+      size_t length = (size + kHugePage - 1) / kHugePage * kHugePage;
+      void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        LOG(WARNING) << "failed to allocate huge-page image, falling back to willneed.";
+        madvise(base, size, MADV_WILLNEED);
+        return;
+      }
+      if (madvise(p, length, MADV_HUGEPAGE) != 0) {
+        LOG(WARNING) << "madvise(MADV_HUGEPAGE) failed, transparent huge pages disabled?";
+      }
+      char* image = static_cast<char*>(p);
+      for (size_t offset = 0; offset < size; offset += kHugePage) {
+        if (stop_warm_up_) {
+          munmap(p, length);
+          return;
+        }
+        std::memcpy(image + offset, base + offset, std::min(kHugePage, size - offset));
+      }
+      if (mprotect(p, length, PROT_READ) != 0) {
+        LOG(WARNING) << "mprotect on huge-page image failed: " << strerror(errno);
+        munmap(p, length);
+        return;
+      }
+      image_size_ = length;
+      pending_image_.store(image, std::memory_order_release);
+      LOG(INFO) << "copied copilot db into " << length / kHugePage << " huge pages in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count()
+                << " ms.";
+    });
+    return;
+  }
+#endif
+  // mmap 的地址按页对齐
+  madvise(base, size, MADV_WILLNEED);
+  if (warm_up_ != copilot::WarmUp::kTouch) {
+    return;
+  }
+  // 后台逐页读取查询一定会访问的部分：metadata、key trie、string table
+  std::vector<std::pair<const char*, size_t>> regions = {{base, sizeof(copilot::Metadata)}};
+  if (metadata_->key_trie) {
+    regions.push_back({metadata_->key_trie.get(),
+                       metadata_->key_trie_size * key_trie_->unit_size()});
+  }
+  if (metadata_->value_trie) {
+    regions.push_back({metadata_->value_trie.get(), metadata_->value_trie_size});
+  }
+  warm_up_thread_ = std::thread([this, regions, page] {
+    auto start = std::chrono::steady_clock::now();
+    volatile char sink = 0;
+    size_t pages = 0;
+    for (const auto& [begin, length] : regions) {
+      for (size_t offset = 0; offset < length && !stop_warm_up_; offset += page, ++pages) {
+        sink = sink + begin[offset];
+      }
+    }
+    LOG(INFO) << "copilot db warm-up touched " << pages << " pages in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " ms.";
+  });
+#endif
+}
+
+void CopilotDb::AdoptImage() {
+  if (!pending_image_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  image_ = pending_image_.exchange(nullptr, std::memory_order_acquire);
+  // OffsetPtr 是相对地址，副本中的 metadata 直接可用
+  metadata_ = reinterpret_cast<copilot::Metadata*>(image_);
+  key_trie_->set_array(metadata_->key_trie.get(), metadata_->key_trie_size);
+  value_trie_ = make_unique<StringTable>(metadata_->value_trie.get(), metadata_->value_trie_size);
+}
 
 bool CopilotDb::Load() {
   LOG(INFO) << "loading copilot db: " << file_path();
 
+  StopWarmUp();
   if (IsOpen()) Close();
+  has_stats_ = false;
 
   if (!OpenReadOnly()) {
     LOG(ERROR) << "error opening copilot db '" << file_path() << "'.";
@@ -35,6 +169,9 @@ bool CopilotDb::Load() {
     Close();
     return false;
   }
+  double format_version = atof(&metadata_->format[kCopilotFormatPrefix.length()]);
+  has_stats_ = format_version >= kStatsFormatVersion - 1e-6;
+  LOG(INFO) << "copilot db format: " << metadata_->format << (has_stats_ ? "" : " (no key stats)");
 
   if (!metadata_->key_trie) {
     LOG(ERROR) << "double array image not found.";
@@ -52,6 +189,7 @@ bool CopilotDb::Load() {
   LOG(INFO) << "found string table of size " << metadata_->value_trie.get() << ".";
   value_trie_ = make_unique<StringTable>(metadata_->value_trie.get(), metadata_->value_trie_size);
 
+  Prefetch();
   return true;
 }
 
@@ -65,17 +203,34 @@ bool CopilotDb::Save() {
 }
 
 int CopilotDb::WriteCandidates(const vector<copilot::RawEntry>& candidates,
-                               const table::Entry* entry) {
+                               const table::Entry* entry, double backoff) {
+  // KeyStats 与 Candidates 连续分配；CreateArray 可能重新映射文件，之后再取 stats 的地址
+  if (!Allocate<copilot::KeyStats>()) {
+    return -1;
+  }
   auto* array = CreateArray<table::Entry>(candidates.size());
+  if (!array) {
+    return -1;
+  }
   auto* next = array->begin();
+  double total = 0;
   for (size_t i = 0; i < candidates.size(); ++i) {
+    total += entry->weight;
     *next++ = *entry++;
   }
+  auto* stats = reinterpret_cast<copilot::KeyStats*>(array) - 1;
+  stats->total = float(total);
+  if (backoff >= 0) {
+    stats->backoff = float(backoff);
+  } else {
+    // Witten-Bell：留给未见后继的概率 = 类型数 / (类型数 + 总数)
+    stats->backoff = float(candidates.size() / (candidates.size() + total));
+  }
   auto offset = reinterpret_cast<char*>(array) - address();
   return int(offset);
 }
 
-bool CopilotDb::Build(const copilot::RawData& data) {
+bool CopilotDb::Build(const copilot::RawData& data, double backoff) {
   // create copilot db
   int data_size = data.size();
   const size_t kReservedSize = 1024;
@@ -91,9 +246,19 @@ bool CopilotDb::Build(const copilot::RawData& data) {
   int i = 0;
   for (const auto& kv : data) {
     if (kv.second.empty()) continue;
+    // 候选按权重降序写入，查询时可以提前结束扫描
+    vector<const copilot::RawEntry*> sorted;
+    sorted.reserve(kv.second.size());
     for (const auto& candidate : kv.second) {
-      string_table.Add(candidate.text, candidate.weight, &entries[i].text.str_id());
-      entries[i].weight = float(candidate.weight);
+      sorted.push_back(&candidate);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const copilot::RawEntry* a, const copilot::RawEntry* b) {
+                       return a->weight > b->weight;
+                     });
+    for (const auto* candidate : sorted) {
+      string_table.Add(candidate->text, candidate->weight, &entries[i].text.str_id());
+      entries[i].weight = float(candidate->weight);
       ++i;
     }
     keys.push_back(kv.first.c_str());
@@ -117,7 +282,12 @@ bool CopilotDb::Build(const copilot::RawData& data) {
   values.reserve(data_size);
   for (const auto& kv : data) {
     if (kv.second.empty()) continue;
-    values.push_back(WriteCandidates(kv.second, available_entries));
+    int offset = WriteCandidates(kv.second, available_entries, backoff);
+    if (offset < 0) {
+      LOG(ERROR) << "Error creating candidates of '" << kv.first << "'.";
+      return false;
+    }
+    values.push_back(offset);
     available_entries += kv.second.size();
   }
   // build real key trie
@@ -150,17 +320,74 @@ bool CopilotDb::Build(const copilot::RawData& data) {
   value_trie_ = make_unique<StringTable>(value_trie_image, value_trie_image_size);
   // at last, complete the metadata
   std::strncpy(metadata_->format, kCopilotFormat.c_str(), kCopilotFormat.length());
+  has_stats_ = true;
   return true;
 }
 
 copilot::Candidates* CopilotDb::Lookup(const string& query) {
+  AdoptImage();
   int result = key_trie_->exactMatchSearch<int>(query.c_str());
   if (result == -1)
     return nullptr;
+  else if (image_)
+    return reinterpret_cast<copilot::Candidates*>(image_ + result);
   else
     return Find<copilot::Candidates>(result);
 }
 
+vector<const table::Entry*> CopilotDb::Top(const copilot::Candidates* candidates,
+                                           size_t k) const {
+  vector<const table::Entry*> top;
+  const size_t n = candidates->size;
+  const auto* entries = candidates->begin();
+  k = std::min(k, n);
+  if (k == 0) {
+    return top;
+  }
+  top.reserve(k);
+  if (has_stats_) {
+    for (size_t i = 0; i < k; ++i) {
+      top.push_back(entries + i);
+    }
+    return top;
+  }
+  // 小顶堆保存当前的前 k 个
+  auto greater = [](const table::Entry* a, const table::Entry* b) { return a->weight > b->weight; };
+  for (size_t i = 0; i < k; ++i) {
+    top.push_back(entries + i);
+  }
+  std::make_heap(top.begin(), top.end(), greater);
+  float threshold = top.front()->weight;
+  auto offer = [&](const table::Entry* e) {
+    if (e->weight > threshold) {
+      std::pop_heap(top.begin(), top.end(), greater);
+      top.back() = e;
+      std::push_heap(top.begin(), top.end(), greater);
+      threshold = top.front()->weight;
+    }
+  };
+  constexpr size_t kBlock = 16;
+  size_t i = k;
+  for (; i + kBlock <= n; i += kBlock) {
+    // 无分支计数，可被编译器向量化；大 fan-out 的 key 绝大多数块在这里被跳过
+    int above = 0;
+    for (size_t j = 0; j < kBlock; ++j) {
+      above += entries[i + j].weight > threshold;
+    }
+    if (above == 0) {
+      continue;
+    }
+    for (size_t j = 0; j < kBlock; ++j) {
+      offer(entries + i + j);
+    }
+  }
+  for (; i < n; ++i) {
+    offer(entries + i);
+  }
+  std::sort_heap(top.begin(), top.end(), greater);
+  return top;
+}
+
 string CopilotDb::GetEntryText(const ::rime::table::Entry& entry) {
   return value_trie_->GetString(entry.text.str_id());
 }
@@ -7,6 +7,9 @@
 #include <rime/dict/table.h>
 #include <rime/resource.h>
 
+#include <atomic>
+#include <thread>
+
 namespace rime {
 
 namespace copilot {
@@ -23,6 +26,16 @@ struct Metadata {
 
 using Candidates = ::rime::Array<::rime::table::Entry>;
 
+// 每个 key 的统计，紧挨在它的 Candidates 之前（1.1 起）
+struct KeyStats {
+  float total;    // 该上下文所有后继的权重和
+  float backoff;  // 回退到更短上下文时乘的系数
+};
+
+// Build 时的回退系数：>= 0 为固定值（stupid backoff），< 0 按 Witten-Bell 逐 key 计算
+constexpr double kStupidBackoff = 0.4;
+constexpr double kWittenBell = -1;
+
 struct RawEntry {
   string text;
   double weight;
@@ -30,23 +43,57 @@ struct RawEntry {
 
 using RawData = map<string, vector<RawEntry>>;
 
+// Load 之后的预热方式
+enum class WarmUp {
+  kNone,
+  kWillNeed,  // madvise(WILLNEED) 整个文件
+  kTouch,     // WILLNEED，并在后台线程逐页读取 metadata / key trie / string table
+  kHugePage,  // 复制到透明大页支持的匿名内存（Linux），不再与其他进程共享页缓存
+};
+WarmUp ParseWarmUp(const string& name);
+
 }  // namespace copilot
 
 class CopilotDb : public MappedFile {
  public:
   CopilotDb(const path& file_path)
       : MappedFile(file_path), key_trie_(new Darts::DoubleArray), value_trie_(new StringTable) {}
+  ~CopilotDb() override;
+
+  // 在 Load 之前设置
+  void set_warm_up(copilot::WarmUp warm_up) { warm_up_ = warm_up; }
 
   bool Load();
   bool Save();
-  bool Build(const copilot::RawData& data);
+  bool Build(const copilot::RawData& data, double backoff = copilot::kStupidBackoff);
   copilot::Candidates* Lookup(const string& query);
+  // 权重最高的 k 个候选（降序）。1.1 起候选已排序，直接取前缀；
+  // 旧格式按块做阈值扫描，只有块内有超过当前第 k 名的权重时才更新堆
+  vector<const table::Entry*> Top(const copilot::Candidates* candidates, size_t k) const;
+  // 候选按权重降序且带有 KeyStats（1.1 起）
+  bool has_stats() const { return has_stats_; }
+  const copilot::KeyStats* GetStats(const copilot::Candidates* candidates) const {
+    return has_stats_ ? reinterpret_cast<const copilot::KeyStats*>(candidates) - 1 : nullptr;
+  }
   string GetEntryText(const ::rime::table::Entry& entry);
 
  private:
-  int WriteCandidates(const vector<copilot::RawEntry>& candidates, const table::Entry* entry);
+  int WriteCandidates(const vector<copilot::RawEntry>& candidates, const table::Entry* entry,
+                      double backoff);
+  // 按 warm_up_ 预热；kHugePage 在后台线程复制，完成后放入 pending_image_
+  void Prefetch();
+  // 在查询线程中切换到已复制好的大页副本
+  void AdoptImage();
+  void StopWarmUp();
 
   copilot::Metadata* metadata_ = nullptr;
+  bool has_stats_ = false;
+  copilot::WarmUp warm_up_ = copilot::WarmUp::kNone;
+  char* image_ = nullptr;  // 大页副本，为空时直接使用 mmap
+  std::atomic<char*> pending_image_{nullptr};  // 后台复制完成、尚未切换的副本
+  size_t image_size_ = 0;
+  std::atomic<bool> stop_warm_up_{false};
+  std::thread warm_up_thread_;
   the<Darts::DoubleArray> key_trie_;
   the<StringTable> value_trie_;
 };
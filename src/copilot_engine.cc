@@ -1,6 +1,8 @@
 #include "copilot_engine.h"
 
+#include <algorithm>
 #include <map>
+#include <unordered_set>
 
 #include <rime/candidate.h>
 #include <rime/context.h>
@@ -15,16 +17,45 @@
 #include <rime/translation.h>
 
 #include "db_provider.h"
+#include "document_provider.h"
 #include "llm_provider.h"
+#include "session_provider.h"
 #include "utils.h"
 
 namespace rime {
 
 static const ResourceType kCopilotDbResourceType = {"copilot_db", "", ""};
 
+int DebounceScheduler::OnCommit() {
+  constexpr double kAlpha = 0.3;
+  auto now = std::chrono::steady_clock::now();
+  ++n_commits_;
+  if (max_delay_ms_ <= 0) {
+    return 0;
+  }
+  if (n_commits_ > 1) {
+    double gap = std::chrono::duration<double, std::milli>(now - last_commit_).count();
+    gap_ms_ = gap_ms_ < 0 ? gap : gap_ms_ * (1 - kAlpha) + gap * kAlpha;
+  }
+  last_commit_ = now;
+  // 平均间隔超过上限时等也等不到下一次提交，不推迟
+  if (gap_ms_ < 0 || gap_ms_ >= max_delay_ms_) {
+    return 0;
+  }
+  ++n_delayed_;
+  int delay = std::min<int>(max_delay_ms_, gap_ms_ * 1.25);
+  DLOG(INFO) << "[copilot] debounce " << delay << " ms, gap: " << int(gap_ms_)
+             << " ms, delayed: " << n_delayed_ << "/" << n_commits_;
+  return delay;
+}
+
 CopilotEngine::CopilotEngine(std::vector<std::shared_ptr<Provider>> providers,
-                             std::shared_ptr<::copilot::History>& history, int max_iterations)
-    : providers_(std::move(providers)), history_(history), max_iterations_(max_iterations) {
+                             std::shared_ptr<::copilot::History>& history, int max_iterations,
+                             int debounce_ms)
+    : providers_(std::move(providers)),
+      history_(history),
+      max_iterations_(max_iterations),
+      scheduler_(debounce_ms) {
   if (providers_.empty()) {
     LOG(ERROR) << "CopilotEngine: no providers";
   }
@@ -36,15 +67,40 @@ bool CopilotEngine::Copilot(Context* ctx, const string& context_query) {
   // LOG(INFO) << "CopilotEngine::Copilot [" << context_query << "]";
   // history_->add(context_query);
   bool ret = false;
+  int delay_ms = scheduler_.OnCommit();
   for (auto& provider : providers_) {
+    provider->SetDelay(delay_ms);
     ret |= provider->Predict(context_query);
   }
   if (ret) {
     query_ = context_query;
+    Rescore();
   }
   return ret;
 }
 
+void CopilotEngine::Rescore() {
+  if (std::none_of(providers_.begin(), providers_.end(),
+                   [](const auto& provider) { return provider->IsRescorer(); })) {
+    return;
+  }
+  std::vector<::copilot::Entry> cands;
+  for (auto& provider : providers_) {
+    if (!provider->IsRescorer()) {
+      auto entries = provider->Retrive(0);
+      cands.insert(cands.end(), entries.begin(), entries.end());
+    }
+  }
+  std::stable_sort(
+      cands.begin(), cands.end(),
+      [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight > b.weight; });
+  for (auto& provider : providers_) {
+    if (provider->IsRescorer()) {
+      provider->Rescore(cands);
+    }
+  }
+}
+
 void CopilotEngine::Clear() {
   DLOG(INFO) << "CopilotEngine::Clear";
   query_.clear();
@@ -81,28 +137,48 @@ const std::vector<::copilot::Entry>& CopilotEngine::candidates() {
   cands_.clear();
 
   std::multimap<size_t, std::vector<::copilot::Entry>> ranks;
+  std::vector<::copilot::Entry> rescored;
   for (auto& provider : providers_) {
     auto cands = provider->Retrive(200'000);
     if (cands.empty()) {
       continue;
     }
-    if (provider->Rank() > 0) {
+    if (provider->IsRescorer()) {
+      rescored.insert(rescored.end(), cands.begin(), cands.end());
+    } else if (provider->Rank() >= 0) {
       ranks.emplace(provider->Rank(), std::move(cands));
     } else {
       cands_.insert(cands_.end(), cands.begin(), cands.end());
     }
   }
-  std::sort(cands_.begin(), cands_.end(), [](const ::copilot::Entry& a, const ::copilot::Entry& b) {
-    return a.weight < b.weight;
-  });
+  std::stable_sort(cands_.begin(), cands_.end(),
+                   [](const ::copilot::Entry& a, const ::copilot::Entry& b) {
+                     return a.weight > b.weight;
+                   });
+  if (!rescored.empty()) {
+    // 重排后的候选替换原来的位置，放在最前面
+    std::unordered_set<std::string> texts;
+    for (auto& entry : rescored) {
+      texts.insert(entry.text);
+    }
+    cands_.erase(std::remove_if(cands_.begin(), cands_.end(),
+                                [&](const ::copilot::Entry& e) { return texts.count(e.text); }),
+                 cands_.end());
+    cands_.insert(cands_.begin(), rescored.begin(), rescored.end());
+  }
   for (auto& rank : ranks) {
     auto& entries = rank.second;
-    std::sort(
+    // 同一 provider 的候选按权重从高到低排列
+    std::stable_sort(
         entries.begin(), entries.end(),
-        [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight < b.weight; });
+        [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight > b.weight; });
     size_t pos = std::min(rank.first, cands_.size());
     cands_.insert(cands_.begin() + pos, entries.begin(), entries.end());
   }
+  // 不同 provider 给出相同的文本时只保留排在前面的
+  std::unordered_set<std::string> seen;
+  auto duplicate = [&](const ::copilot::Entry& e) { return !seen.insert(e.text).second; };
+  cands_.erase(std::remove_if(cands_.begin(), cands_.end(), duplicate), cands_.end());
 
   /*
   for (size_t i = 0; i < cands_.size(); ++i) {
@@ -133,16 +209,37 @@ CopilotEngineComponent::~CopilotEngineComponent() {}
 CopilotEngine* CopilotEngineComponent::Create(const Ticket& ticket) {
   std::vector<std::shared_ptr<Provider>> providers;
   string db_name = "copilot.db";
+  std::vector<std::pair<string, double>> db_layers;
+  string db_warm_up;
   int max_iterations = 0;
+  int debounce_ms = 0;
 
   DBProvider::Config db_config;
+  SessionProvider::Config session_config;
+  bool session_enabled = false;
+  DocumentProvider::Config document_config;
+  bool document_enabled = false;
   LLMProvider::Config llm_config;
   string model_name = "";
+  string state_name = "";
   if (auto* schema = ticket.schema) {
     auto* config = schema->config();
-    if (config->GetString("copilot/db", &db_name)) {
+    if (auto list = config->GetList("copilot/db")) {
+      // 多个 DB：列表项为文件名，或 {name, weight}
+      for (size_t i = 0; i < list->size(); ++i) {
+        string prefix = "copilot/db/@" + std::to_string(i);
+        string name;
+        double weight = 1.0;
+        if (config->GetString(prefix, &name) || config->GetString(prefix + "/name", &name)) {
+          config->GetDouble(prefix + "/weight", &weight);
+          db_layers.push_back({name, weight});
+        }
+      }
+      LOG(INFO) << "custom copilot/db: " << db_layers.size() << " layers";
+    } else if (config->GetString("copilot/db", &db_name)) {
       LOG(INFO) << "custom copilot/db: " << db_name;
     }
+    config->GetString("copilot/db_warm_up", &db_warm_up);
     if (!config->GetInt("copilot/max_candidates", &db_config.max_candidates)) {
       LOG(INFO) << "copilot/max_candidates is not set in schema";
     }
@@ -152,14 +249,48 @@ CopilotEngine* CopilotEngineComponent::Create(const Ticket& ticket) {
     if (!config->GetInt("copilot/max_iterations", &max_iterations)) {
       LOG(INFO) << "copilot/max_iterations is not set in schema";
     }
+    config->GetInt("copilot/beam_width", &db_config.beam_width);
+    config->GetInt("copilot/beam_depth", &db_config.beam_depth);
+    if (config->GetBool("copilot/session/enable", &session_enabled) && session_enabled) {
+      config->GetInt("copilot/session/rank", &session_config.rank);
+      config->GetInt("copilot/session/order", &session_config.order);
+      config->GetInt("copilot/session/max_entries", &session_config.max_entries);
+      config->GetInt("copilot/session/max_candidates", &session_config.max_candidates);
+    }
+    if (config->GetBool("copilot/document/enable", &document_enabled) && document_enabled) {
+      config->GetInt("copilot/document/rank", &document_config.rank);
+      config->GetInt("copilot/document/max_candidates", &document_config.max_candidates);
+      config->GetInt("copilot/document/max_chars", &document_config.max_chars);
+      config->GetInt("copilot/document/context_chars", &document_config.context_chars);
+    }
     if (config->GetString("copilot/llm/model", &model_name)) {
       config->GetInt("copilot/llm/max_history", &llm_config.max_history);
       config->GetInt("copilot/llm/n_predict", &llm_config.n_predict);
       config->GetInt("copilot/llm/rank", &llm_config.rank);
       config->GetBool("copilot/llm/battery_active", &llm_config.battery_active);
+      config->GetString("copilot/llm/battery_mode", &llm_config.battery_mode);
+      config->GetInt("copilot/llm/n_threads", &llm_config.n_threads);
+      config->GetInt("copilot/llm/latency_budget_ms", &llm_config.latency_budget_ms);
+      config->GetInt("copilot/llm/idle_unload_seconds", &llm_config.idle_unload_seconds);
+      config->GetBool("copilot/llm/unload_model", &llm_config.unload_model);
+      config->GetString("copilot/llm/backend", &llm_config.backend);
+      config->GetInt("copilot/llm/max_sessions", &llm_config.max_sessions);
+      config->GetInt("copilot/llm/n_ctx", &llm_config.n_ctx);
+      config->GetInt("copilot/llm/max_context_tokens", &llm_config.max_context_tokens);
+      config->GetBool("copilot/llm/stop_at_boundary", &llm_config.stop_at_boundary);
+      config->GetDouble("copilot/llm/min_confidence", &llm_config.min_confidence);
+      config->GetInt("copilot/llm/max_splits", &llm_config.max_splits);
+      config->GetDouble("copilot/llm/split_decay", &llm_config.split_decay);
+      config->GetBool("copilot/llm/split_with_db", &llm_config.split_with_db);
+      config->GetString("copilot/llm/mode", &llm_config.mode);
+      config->GetInt("copilot/llm/rescore_top_k", &llm_config.rescore_top_k);
+      config->GetString("copilot/llm/vocab_mask", &llm_config.vocab_mask);
+      config->GetString("copilot/llm/state_file", &state_name);
+      config->GetInt("copilot/llm/debounce_ms", &debounce_ms);
     }
   }
   std::shared_ptr<::copilot::History> history = std::make_shared<::copilot::History>(100);
+  std::shared_ptr<LLMProvider> llm;
   if (!model_name.empty()) {
     auto r =
         the<ResourceResolver>(Service::instance().CreateResourceResolver(kCopilotLLMResourceType));
@@ -167,19 +298,45 @@ CopilotEngine* CopilotEngineComponent::Create(const Ticket& ticket) {
     if (std::filesystem::exists(model_path)) {
       LOG(INFO) << "[copilot] LLM: " << model_path;
       llm_config.model = model_path;
-      providers.push_back(std::make_shared<LLMProvider>(llm_config, history));
+      if (!state_name.empty()) {
+        llm_config.state_file = r->ResolvePath(state_name);
+      }
+      llm = std::make_shared<LLMProvider>(llm_config, history);
+      providers.push_back(llm);
     }
   }
-  if (auto db = db_pool_.GetDb(db_name)) {
+  if (db_layers.empty()) {
+    db_layers.push_back({db_name, 1.0});
+  }
+  // 每个 DB 单独 mmap（只读），由 db_pool_ 在各方案间共享
+  std::vector<DBProvider::Layer> layers;
+  for (const auto& [name, weight] : db_layers) {
+    auto db = db_pool_.GetDb(name);
+    if (!db) {
+      continue;
+    }
+    db->set_warm_up(copilot::ParseWarmUp(db_warm_up));
     if (db->IsOpen() || db->Load()) {
-      LOG(INFO) << "[copilot] DB: " << db_name;
-      providers.push_back(std::make_shared<DBProvider>(db, history, db_config));
+      LOG(INFO) << "[copilot] DB: " << name << ", weight: " << weight;
+      layers.push_back({db, weight});
     } else {
-      LOG(ERROR) << "failed to load copilot db: " << db_name;
+      LOG(ERROR) << "failed to load copilot db: " << name;
+    }
+  }
+  if (!layers.empty()) {
+    if (llm) {
+      llm->set_db(layers.front().db);
     }
+    providers.push_back(std::make_shared<DBProvider>(std::move(layers), history, db_config));
+  }
+  if (session_enabled) {
+    providers.push_back(std::make_shared<SessionProvider>(session_config));
+  }
+  if (document_enabled) {
+    providers.push_back(std::make_shared<DocumentProvider>(document_config, history));
   }
   if (!providers.empty()) {
-    return new CopilotEngine(providers, history, max_iterations);
+    return new CopilotEngine(providers, history, max_iterations, debounce_ms);
   }
   return nullptr;
 }
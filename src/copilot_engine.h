@@ -1,6 +1,8 @@
 #ifndef RIME_PREDICT_ENGINE_H_
 #define RIME_PREDICT_ENGINE_H_
 
+#include <chrono>
+
 #include <rime/component.h>
 #include <rime/dict/db_pool.h>
 #include "copilot_db.h"
@@ -15,10 +17,28 @@ struct Segment;
 struct Ticket;
 class Translation;
 
+// 根据最近的提交间隔给异步 provider 定安静期：连续快速提交时推迟推理，
+// 下一次提交若在安静期内到来，上一次就不必 decode
+class DebounceScheduler {
+ public:
+  explicit DebounceScheduler(int max_delay_ms) : max_delay_ms_(max_delay_ms) {}
+
+  // 记录一次提交，返回本次推理的推迟时间（毫秒）
+  int OnCommit();
+
+ private:
+  int max_delay_ms_;
+  double gap_ms_ = -1;  // 提交间隔的指数滑动平均
+  std::chrono::steady_clock::time_point last_commit_;
+  uint64_t n_commits_ = 0;
+  uint64_t n_delayed_ = 0;
+};
+
 class CopilotEngine : public Class<CopilotEngine, const Ticket&> {
  public:
   CopilotEngine(std::vector<std::shared_ptr<Provider>> providers,
-                std::shared_ptr<::copilot::History>& history, int max_iterations);
+                std::shared_ptr<::copilot::History>& history, int max_iterations,
+                int debounce_ms = 0);
   virtual ~CopilotEngine();
 
   bool Copilot(Context* ctx, const string& context_query);
@@ -34,12 +54,16 @@ class CopilotEngine : public Class<CopilotEngine, const Ticket&> {
   void BackSpace();
 
  private:
+  // 把其他 provider 的候选交给重排器
+  void Rescore();
+
   int max_iterations_;  // copilot times limit
   string query_;        // cache last query
 
   std::vector<std::shared_ptr<Provider>> providers_;
   std::vector<::copilot::Entry> cands_;
   std::shared_ptr<::copilot::History> history_;
+  DebounceScheduler scheduler_;
 };
 
 class CopilotEngineComponent : public CopilotEngine::Component {
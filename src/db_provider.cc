@@ -0,0 +1,233 @@
+#include "db_provider.h"
+
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <unordered_set>
+
+#include <glog/logging.h>
+
+namespace rime {
+
+std::list<::copilot::Entry> DBProvider::Lookup(const std::string& input) const {
+  struct Cursor {
+    const Layer* layer;
+    std::vector<const table::Entry*> top;  // 降序
+    size_t pos = 0;
+    double weight() const { return top[pos]->weight * layer->weight; }
+  };
+  std::vector<Cursor> cursors;
+  for (const auto& layer : layers_) {
+    if (auto* candidates = layer.db->Lookup(input)) {
+      auto top = layer.db->Top(candidates, config_.max_candidates);
+      if (!top.empty()) {
+        cursors.push_back({&layer, std::move(top)});
+      }
+    }
+  }
+  auto less = [&](size_t a, size_t b) { return cursors[a].weight() < cursors[b].weight(); };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(less)> heap(less);
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    heap.push(i);
+  }
+  std::list<::copilot::Entry> result;
+  std::unordered_set<std::string> seen;
+  while (!heap.empty() && result.size() < size_t(config_.max_candidates)) {
+    size_t i = heap.top();
+    heap.pop();
+    auto& cursor = cursors[i];
+    auto text = cursor.layer->db->GetEntryText(*cursor.top[cursor.pos]);
+    if (seen.insert(text).second) {
+      result.push_back({text, cursor.weight(), ::copilot::ProviderType::kDB});
+    }
+    if (++cursor.pos < cursor.top.size()) {
+      heap.push(i);
+    }
+  }
+  return result;
+}
+
+const std::vector<DBProvider::Hop>& DBProvider::Expand(
+    const std::string& context, std::unordered_map<std::string, std::vector<Hop>>* memo) const {
+  ::copilot::UTF8 chars(context);
+  int n = std::min<int>(chars.size(), config_.max_hints);
+  std::string tail(n > 0 ? chars(-n, -1) : std::string_view());
+  auto [it, inserted] = memo->try_emplace(tail);
+  if (!inserted) {
+    return it->second;
+  }
+  auto& hops = it->second;
+  for (int k = n; k >= 1 && hops.empty(); --k) {
+    std::string key(chars(-k, -1));
+    for (const auto& layer : layers_) {
+      auto* candidates = layer.db->Lookup(key);
+      if (!candidates || candidates->size == 0) {
+        continue;
+      }
+      // 按权重取前 beam_width 个，概率以该 key 下所有后继的权重和归一化
+      double total = 0;
+      if (auto* stats = layer.db->GetStats(candidates)) {
+        total = stats->total;
+      } else {
+        for (auto* e = candidates->begin(); e != candidates->end(); ++e) {
+          total += e->weight;
+        }
+      }
+      for (const auto* e : layer.db->Top(candidates, config_.beam_width)) {
+        if (total > 0) {
+          hops.push_back({layer.db->GetEntryText(*e), e->weight * layer.weight,
+                          layer.weight * e->weight / total});
+        }
+      }
+    }
+    if (layers_.size() > 1) {
+      std::stable_sort(hops.begin(), hops.end(),
+                       [](const Hop& a, const Hop& b) { return a.prob > b.prob; });
+      std::unordered_set<std::string> seen;
+      hops.erase(std::remove_if(hops.begin(), hops.end(),
+                                [&](const Hop& hop) { return !seen.insert(hop.text).second; }),
+                 hops.end());
+      if (hops.size() > size_t(config_.beam_width)) {
+        hops.resize(config_.beam_width);
+      }
+    }
+  }
+  return hops;
+}
+
+std::vector<::copilot::Entry> DBProvider::Backoff(
+    const std::vector<std::string>& contexts) const {
+  const size_t limit = config_.max_candidates;
+  struct Score {
+    double value = 0;
+    size_t level = 0;  // 给出该分数的上下文在 contexts 中的下标
+  };
+  std::unordered_map<std::string, Score> scores;
+  std::vector<double> values;
+  // 每层各自的回退系数之积
+  std::vector<double> multipliers(layers_.size(), 1.0);
+  // 更长的上下文先查；每短一级，分数乘以上一级的 backoff。
+  // 同一 text 只取出现它的最长上下文的分数（各层在同一级取最高），更短的上下文不再覆盖
+  for (size_t level = 0; level < contexts.size(); ++level) {
+    const auto& context = contexts[level];
+    // 当前第 limit 高的分数，低于它的不会进入结果
+    double threshold = 0;
+    if (scores.size() >= limit) {
+      values.clear();
+      for (const auto& [text, score] : scores) {
+        values.push_back(score.value);
+      }
+      std::nth_element(values.begin(), values.begin() + (limit - 1), values.end(),
+                       std::greater<double>());
+      threshold = values[limit - 1];
+      double bound = 0;
+      for (size_t l = 0; l < layers_.size(); ++l) {
+        bound = std::max(bound, layers_[l].weight * multipliers[l]);
+      }
+      if (threshold >= bound) {
+        break;  // 更短的上下文给出的分数不会超过 bound
+      }
+    }
+    for (size_t l = 0; l < layers_.size(); ++l) {
+      const auto& db = layers_[l].db;
+      auto* candidates = db->Lookup(context);
+      if (!candidates) {
+        continue;
+      }
+      auto* stats = db->GetStats(candidates);
+      if (stats->total <= 0) {
+        continue;
+      }
+      double multiplier = layers_[l].weight * multipliers[l];
+      size_t taken = 0;
+      for (auto* e = candidates->begin(); e != candidates->end() && taken < limit; ++e) {
+        double score = multiplier * e->weight / stats->total;
+        if (score <= threshold) {
+          break;  // 候选按权重降序
+        }
+        auto [it, inserted] = scores.try_emplace(db->GetEntryText(*e), Score{score, level});
+        if (!inserted) {
+          if (it->second.level < level) {
+            continue;  // 更长的上下文里已经有它
+          }
+          it->second.value = std::max(it->second.value, score);
+        }
+        ++taken;
+      }
+      multipliers[l] *= stats->backoff;
+    }
+  }
+  std::vector<::copilot::Entry> result;
+  result.reserve(scores.size());
+  for (auto& [text, score] : scores) {
+    result.push_back({text, score.value, ::copilot::ProviderType::kDB});
+  }
+  std::sort(result.begin(), result.end(),
+            [](const ::copilot::Entry& a, const ::copilot::Entry& b) {
+              return a.weight > b.weight || (a.weight == b.weight && a.text < b.text);
+            });
+  if (result.size() > limit) {
+    result.resize(limit);
+  }
+  return result;
+}
+
+std::vector<::copilot::Entry> DBProvider::BeamSearch(const std::string& context) const {
+  struct Path {
+    std::string text;
+    double weight = 0;  // 首词的权重
+    double log_p = 0;   // 后续各跳的对数条件概率之和
+    double score() const { return std::log(weight) + log_p; }
+  };
+  auto start = std::chrono::steady_clock::now();
+  std::unordered_map<std::string, std::vector<Hop>> memo;
+  std::vector<Path> beam = {Path{}};
+  std::vector<Path> results;
+  for (int depth = 1; depth <= config_.beam_depth && !beam.empty(); ++depth) {
+    std::vector<Path> next;
+    for (const auto& path : beam) {
+      for (const auto& hop : Expand(context + path.text, &memo)) {
+        if (hop.weight <= 0 || ::copilot::IsPunct(hop.text)) {
+          continue;
+        }
+        if (depth == 1) {
+          // 带 KeyStats 时与 Backoff 的分数一致，用概率
+          next.push_back({hop.text, has_stats() ? hop.prob : hop.weight, 0});
+        } else {
+          next.push_back({path.text + hop.text, path.weight, path.log_p + std::log(hop.prob)});
+        }
+      }
+    }
+    auto by_score = [](const Path& a, const Path& b) { return a.score() > b.score(); };
+    size_t m = std::min<size_t>(next.size(), config_.beam_width);
+    std::partial_sort(next.begin(), next.begin() + m, next.end(), by_score);
+    next.resize(m);
+    if (depth >= 2) {
+      results.insert(results.end(), next.begin(), next.end());
+    }
+    beam.swap(next);
+  }
+  std::stable_sort(results.begin(), results.end(),
+                   [](const Path& a, const Path& b) { return a.score() > b.score(); });
+  std::vector<::copilot::Entry> phrases;
+  std::unordered_set<std::string> seen;
+  for (const auto& path : results) {
+    if (phrases.size() >= size_t(config_.beam_width)) {
+      break;
+    }
+    if (seen.insert(path.text).second) {
+      phrases.push_back(
+          {path.text, path.weight * std::exp(path.log_p), ::copilot::ProviderType::kDB});
+    }
+  }
+  DLOG(INFO) << "[DB] beam search: " << phrases.size() << " phrases, " << memo.size()
+             << " lookups, "
+             << std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start)
+                    .count()
+             << " us";
+  return phrases;
+}
+
+}  // namespace rime
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <limits>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "copilot_db.h"
@@ -15,16 +17,27 @@ class DBProvider : public Provider {
   struct Config {
     int max_candidates = -1;
     int max_hints = -1;
+    int beam_width = 0;  // 多词续写的 beam 宽度（也是续写候选数），0 关闭
+    int beam_depth = 3;  // 续写最多串联的词数
+  };
+  // 一个 DB 及其权重系数；多个 DB 的查询结果合并去重
+  struct Layer {
+    std::shared_ptr<CopilotDb> db;
+    double weight = 1.0;
   };
   DBProvider(const std::shared_ptr<CopilotDb>& db,
              const std::shared_ptr<::copilot::History>& history, const Config& config)
-      : db_(db), history_(history), config_(config) {
+      : DBProvider(std::vector<Layer>{{db, 1.0}}, history, config) {}
+  DBProvider(std::vector<Layer> layers, const std::shared_ptr<::copilot::History>& history,
+             const Config& config)
+      : layers_(std::move(layers)), history_(history), config_(config) {
     if (config_.max_candidates <= 0) {
       config_.max_candidates = std::numeric_limits<int>::max();
     }
     if (config_.max_hints <= 0) {
       config_.max_hints = std::numeric_limits<int>::max();
     }
+    config_.beam_depth = std::clamp(config_.beam_depth, 2, 4);
   }
   virtual ~DBProvider() = default;
 
@@ -34,21 +47,29 @@ class DBProvider : public Provider {
   std::vector<::copilot::Entry> Retrive(int timeout_us) const override { return candidates_; }
 
  private:
-  std::list<::copilot::Entry> Lookup(const std::string& input) const {
-    std::list<::copilot::Entry> result;
-    auto* candidates = db_->Lookup(input);
-    if (!candidates) {
-      return result;
-    }
-    uint32_t size = std::min<int>(candidates->size, config_.max_candidates);
-    auto* it = candidates->begin();
-    for (uint32_t i = 0; i < size; ++i, ++it) {
-      auto text = db_->GetEntryText(*it);
-      result.push_back({text, it->weight, ::copilot::ProviderType::kDB});
-    }
-    return result;
+  // 一跳的后继：权重和归一化后的概率
+  struct Hop {
+    std::string text;
+    double weight;
+    double prob;
+  };
+  // context 末尾最长的、在 DB 中存在的 key 的前 beam_width 个后继（同一次搜索内缓存）
+  const std::vector<Hop>& Expand(const std::string& context,
+                                 std::unordered_map<std::string, std::vector<Hop>>* memo) const;
+  // 串联多跳 Lookup，给出 2 ~ beam_depth 个词的续写
+  std::vector<::copilot::Entry> BeamSearch(const std::string& context) const;
+  // 带 KeyStats 的 DB：从长到短逐级回退打分（stupid backoff / Witten-Bell）
+  std::vector<::copilot::Entry> Backoff(const std::vector<std::string>& contexts) const;
+
+  // 各层前 max_candidates 个候选（乘以层权重）的 k 路归并，同一文本只保留权重最高的
+  std::list<::copilot::Entry> Lookup(const std::string& input) const;
+  // 所有层都带 KeyStats 时按回退打分
+  bool has_stats() const {
+    return std::all_of(layers_.begin(), layers_.end(),
+                       [](const Layer& layer) { return layer.db->has_stats(); });
   }
-  std::shared_ptr<CopilotDb> db_;
+
+  std::vector<Layer> layers_;
   std::vector<::copilot::Entry> candidates_;
   Config config_;
   std::shared_ptr<::copilot::History> history_;
@@ -57,27 +78,52 @@ class DBProvider : public Provider {
 inline bool DBProvider::Predict(const std::string& input) {
   candidates_.clear();
   auto hist = history_->back();
-  auto candidates = Lookup(hist);
-  for (uint32_t i = 2; i < config_.max_hints; ++i) {
-    auto curr = history_->get_chars(i);
-    // LOG(INFO) << "DBProvider::Predict: " << i << ", curr: " << curr << ", hist: " << hist
-    //           << " max_hints: " << config_.max_hints;
-    if (curr == hist) {
-      // LOG(INFO) << "DBProvider::Predict: " << i << ", curr == hist";
-      break;
+  if (has_stats()) {
+    std::vector<std::string> contexts = {hist};
+    for (uint32_t i = 2; i < config_.max_hints; ++i) {
+      auto curr = history_->get_chars(i);
+      if (curr == contexts.back()) {
+        break;
+      }
+      contexts.push_back(std::move(curr));
+    }
+    // 最近一次提交可能比 get_chars 的结果更长：按长度从长到短回退
+    std::stable_sort(
+        contexts.begin(), contexts.end(),
+        [](const std::string& a, const std::string& b) { return a.size() > b.size(); });
+    contexts.erase(std::unique(contexts.begin(), contexts.end()), contexts.end());
+    candidates_ = Backoff(contexts);
+    if (candidates_.empty()) {
+      return false;
+    }
+  } else {
+    auto candidates = Lookup(hist);
+    for (uint32_t i = 2; i < config_.max_hints; ++i) {
+      auto curr = history_->get_chars(i);
+      // LOG(INFO) << "DBProvider::Predict: " << i << ", curr: " << curr << ", hist: " << hist
+      //           << " max_hints: " << config_.max_hints;
+      if (curr == hist) {
+        // LOG(INFO) << "DBProvider::Predict: " << i << ", curr == hist";
+        break;
+      }
+      auto hint_candidates = Lookup(curr);
+      hist.swap(curr);
+      candidates.splice(candidates.end(), hint_candidates);
+    }
+    if (candidates.empty()) {
+      return false;
     }
-    auto hint_candidates = Lookup(curr);
-    hist.swap(curr);
-    candidates.splice(candidates.end(), hint_candidates);
+    candidates.sort(
+        [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight > b.weight; });
+    candidates_ = {candidates.begin(),
+                   std::next(candidates.begin(),
+                             std::min<uint32_t>(candidates.size(), config_.max_candidates))};
   }
-  if (candidates.empty()) {
-    return false;
+  if (config_.beam_width > 0) {
+    // 续写的权重不超过首词，单独计数，不占 max_candidates
+    auto phrases = BeamSearch(history_->get_chars(config_.max_hints));
+    candidates_.insert(candidates_.end(), phrases.begin(), phrases.end());
   }
-  candidates.sort(
-      [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight > b.weight; });
-  candidates_ = {
-      candidates.begin(),
-      std::next(candidates.begin(), std::min<uint32_t>(candidates.size(), config_.max_candidates))};
   return true;
 }
 
@@ -0,0 +1,190 @@
+#include "document_index.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+#include "history.h"
+
+namespace rime {
+
+namespace {
+using ::copilot::IsPunct;
+using ::copilot::Utf8Len;
+
+constexpr size_t kMaxProbes = 256;  // 每次查询最多检查的出现位置（从最近的开始）
+
+inline bool IsContinuation(unsigned char c) { return (c & 0xC0) == 0x80; }
+
+inline size_t PrevChar(std::string_view s, size_t pos) {
+  while (pos > 0 && IsContinuation(s[--pos])) {
+  }
+  return pos;
+}
+
+// 续写到这些字符为止：文档里的全角空格也算，人名中的间隔号不算
+inline bool IsBoundary(std::string_view c) {
+  return c == "　" || (c != "·" && IsPunct(c));
+}
+}  // namespace
+
+size_t DocumentIndex::Bigram(size_t pos) const {
+  size_t a = pos + Utf8Len(text_[pos]);
+  if (a >= text_.size()) {
+    return 0;
+  }
+  size_t b = a + Utf8Len(text_[a]);
+  return b > text_.size() ? 0 : b - pos;
+}
+
+uint64_t DocumentIndex::Key(size_t pos) const {
+  return std::hash<std::string_view>{}(std::string_view(text_).substr(pos, Bigram(pos)));
+}
+
+void DocumentIndex::Index(size_t from) {
+  for (size_t pos = from; pos < text_.size() && Bigram(pos) > 0; pos += Utf8Len(text_[pos])) {
+    grams_[Key(pos)].push_back(base_ + pos);
+  }
+}
+
+void DocumentIndex::Unindex(size_t from) {
+  std::vector<size_t> positions;
+  for (size_t pos = from; pos < text_.size() && Bigram(pos) > 0; pos += Utf8Len(text_[pos])) {
+    positions.push_back(pos);
+  }
+  // 倒序移除：同一 bigram 的位置升序排列，要删的总在末尾
+  for (auto pos = positions.rbegin(); pos != positions.rend(); ++pos) {
+    auto it = grams_.find(Key(*pos));
+    if (it == grams_.end()) {
+      continue;
+    }
+    auto& list = it->second;
+    if (!list.empty() && list.back() == base_ + *pos) {
+      list.pop_back();
+    }
+    if (list.empty()) {
+      grams_.erase(it);
+    }
+  }
+}
+
+void DocumentIndex::DropFront(size_t n) {
+  while (n < text_.size() && IsContinuation(text_[n])) {
+    ++n;
+  }
+  for (size_t pos = 0; pos < n && Bigram(pos) > 0; pos += Utf8Len(text_[pos])) {
+    auto it = grams_.find(Key(pos));
+    if (it == grams_.end()) {
+      continue;
+    }
+    auto& list = it->second;
+    if (!list.empty() && list.front() == base_ + pos) {
+      list.pop_front();
+    }
+    if (list.empty()) {
+      grams_.erase(it);
+    }
+  }
+  text_.erase(0, n);
+  base_ += n;
+}
+
+void DocumentIndex::Reset() {
+  text_.clear();
+  grams_.clear();
+  base_ = 0;
+  cursor_ = std::string::npos;
+}
+
+bool DocumentIndex::Update(size_t offset, std::string_view text) {
+  bool in_window = offset >= base_ && offset <= end() &&
+                   (offset == end() || !IsContinuation(text_[offset - base_]));
+  if (text.size() > max_bytes_) {
+    // 新文本本身就超过窗口：只保留末尾 max_bytes_ 字节，不为马上要丢掉的部分建索引
+    size_t skip = text.size() - max_bytes_;
+    while (skip < text.size() && IsContinuation(text[skip])) {
+      ++skip;
+    }
+    Reset();
+    base_ = offset + skip;
+    text_.assign(text.substr(skip));
+    Index(0);
+    return in_window;
+  }
+  if (!in_window) {
+    // 编辑位置不在窗口内：从 offset 开始重新建立窗口
+    Reset();
+    base_ = offset;
+    text_.assign(text);
+    Index(0);
+  } else {
+    size_t cut = offset - base_;
+    // 跨过 cut 的那个 bigram 也要重新索引
+    size_t first = PrevChar(text_, cut);
+    Unindex(first);
+    text_.resize(cut);
+    text_.append(text);
+    Index(first);
+  }
+  if (text_.size() > max_bytes_) {
+    // 多丢四分之一，避免每次更新都移动窗口
+    DropFront(text_.size() - max_bytes_ + max_bytes_ / 4);
+  }
+  return in_window;
+}
+
+std::vector<DocumentIndex::Match> DocumentIndex::Complete(std::string_view context,
+                                                          size_t max_results,
+                                                          size_t max_chars) const {
+  std::vector<Match> matches;
+  size_t last = PrevChar(context, context.size());
+  if (last == 0) {
+    return matches;  // 不足两个字符
+  }
+  size_t k = PrevChar(context, last);
+  auto it = grams_.find(std::hash<std::string_view>{}(context.substr(k)));
+  if (it == grams_.end()) {
+    return matches;
+  }
+  const auto& list = it->second;
+  const size_t n_key = context.size() - k;
+  size_t probes = 0;
+  for (auto p = list.rbegin(); p != list.rend() && probes < kMaxProbes; ++p, ++probes) {
+    size_t start = *p - base_;
+    size_t end = start + n_key;
+    if (text_.compare(start, n_key, context, k, n_key) != 0 || base_ + end == cursor_) {
+      continue;
+    }
+    // 向前延伸匹配
+    size_t length = n_key;
+    while (length < context.size() && length - n_key < start &&
+           text_[start - (length - n_key) - 1] == context[context.size() - length - 1]) {
+      ++length;
+    }
+    Match match{"", length, base_ + end};
+    size_t pos = end;
+    for (size_t n = 0; n < max_chars && pos < text_.size(); ++n) {
+      size_t len = std::min(Utf8Len(text_[pos]), text_.size() - pos);
+      if (IsBoundary(std::string_view(text_).substr(pos, len))) {
+        break;
+      }
+      match.text.append(text_, pos, len);
+      pos += len;
+    }
+    if (!match.text.empty()) {
+      matches.push_back(std::move(match));
+    }
+  }
+  std::stable_sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) {
+    return a.length > b.length;
+  });
+  std::unordered_set<std::string> seen;
+  auto duplicate = [&](const Match& m) { return !seen.insert(m.text).second; };
+  matches.erase(std::remove_if(matches.begin(), matches.end(), duplicate), matches.end());
+  if (matches.size() > max_results) {
+    matches.resize(max_results);
+  }
+  return matches;
+}
+
+}  // namespace rime
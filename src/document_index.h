@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace rime {
+
+// 编辑器文档的一个窗口（最多 max_bytes 字节）及其字符 bigram 索引。
+// 偏移都是文档中的 UTF-8 字节偏移；更新只替换 offset 之后的部分，索引随之增量维护
+class DocumentIndex {
+ public:
+  struct Match {
+    std::string text;     // 匹配之后的文本
+    size_t length = 0;    // 与 context 末尾匹配的字节数
+    size_t position = 0;  // 匹配结束处的文档偏移
+  };
+
+  explicit DocumentIndex(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // 把文档 [offset, ∞) 替换为 text；offset 落在窗口之前（或之后有空洞）时返回 false
+  bool Update(size_t offset, std::string_view text);
+  void Reset();
+  void set_cursor(size_t cursor) { cursor_ = cursor; }
+
+  // context 末尾在文档中出现的位置之后的文本，到标点 / 空白为止，最多 max_chars 个字符。
+  // 匹配越长越靠前，同样长时越靠后（离光标越近）越靠前
+  std::vector<Match> Complete(std::string_view context, size_t max_results,
+                              size_t max_chars) const;
+
+  size_t base() const { return base_; }
+  size_t end() const { return base_ + text_.size(); }
+
+ private:
+  // 以 [from, to) 内的字符开头的 bigram（窗口内位置）
+  void Index(size_t from);
+  void Unindex(size_t from);
+  void DropFront(size_t n);
+  uint64_t Key(size_t pos) const;
+  size_t Bigram(size_t pos) const;  // pos 处 bigram 的字节数，不足两个字符时为 0
+
+  size_t max_bytes_;
+  std::string text_;
+  size_t base_ = 0;                   // text_[0] 的文档偏移
+  size_t cursor_ = std::string::npos;  // 光标处的匹配就是刚输入的文本，跳过
+  // bigram → 起始偏移（文档偏移，升序）
+  std::unordered_map<uint64_t, std::deque<size_t>> grams_;
+};
+
+}  // namespace rime
@@ -0,0 +1,41 @@
+#include "document_provider.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+#include "ime_bridge.h"
+
+namespace rime {
+
+DocumentProvider::DocumentProvider(const Config& config,
+                                   const std::shared_ptr<::copilot::History>& history)
+    : config_(config), history_(history) {
+  --config_.rank;
+  if (config_.max_candidates <= 0) {
+    config_.max_candidates = 3;
+  }
+  config_.max_chars = std::max(1, config_.max_chars);
+  config_.context_chars = std::max(2, config_.context_chars);
+  LOG(INFO) << "[Document] max_chars:" << config_.max_chars
+            << ", context_chars:" << config_.context_chars << ", rank:" << config_.rank;
+}
+
+bool DocumentProvider::Predict(const std::string& input) {
+  candidates_.clear();
+  auto& server = ImeBridgeServer::Instance();
+  if (input.empty() || !server.IsRunning()) {
+    return false;
+  }
+  auto context = history_->get_chars(config_.context_chars);
+  auto matches = server.CompleteFromDocument(context, config_.max_candidates, config_.max_chars);
+  for (const auto& match : matches) {
+    // 与上下文匹配得越长越可信
+    double weight = double(match.length) / context.size();
+    candidates_.push_back({match.text, weight, ::copilot::ProviderType::kDocument});
+  }
+  DLOG(INFO) << "[Document] context: " << context << ", matches: " << candidates_.size();
+  return !candidates_.empty();
+}
+
+}  // namespace rime
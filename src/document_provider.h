@@ -0,0 +1,36 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "history.h"
+#include "provider.h"
+
+namespace rime {
+
+// 当前编辑器文档中的续写：在 ImeBridge 客户端发来的文档里查找最近提交的文本，
+// 给出它在文档中出现处之后的内容（编辑器没有发送 document 时没有候选）
+class DocumentProvider : public Provider {
+ public:
+  struct Config {
+    int rank = 1;
+    int max_candidates = 3;
+    int max_chars = 8;      // 每个候选最多的字符数
+    int context_chars = 8;  // 用于匹配的历史字符数
+  };
+  DocumentProvider(const Config& config, const std::shared_ptr<::copilot::History>& history);
+  virtual ~DocumentProvider() = default;
+
+  void Clear() override { candidates_.clear(); }
+  int Rank() const override { return config_.rank; }
+  bool Predict(const std::string& input) override;
+  std::vector<::copilot::Entry> Retrive(int timeout_us) const override { return candidates_; }
+
+ private:
+  Config config_;
+  std::shared_ptr<::copilot::History> history_;
+  std::vector<::copilot::Entry> candidates_;
+};
+
+}  // namespace rime
@@ -0,0 +1,160 @@
+#include "event_loop.h"
+
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+namespace copilot {
+
+EventLoop& EventLoop::Instance() {
+  static EventLoop instance;
+  return instance;
+}
+
+EventLoop::EventLoop() {
+#ifdef __linux__
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+EventLoop::~EventLoop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  Wakeup();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+#ifdef __linux__
+  if (wake_fd_ >= 0) {
+    close(wake_fd_);
+  }
+#endif
+}
+
+void EventLoop::EnsureStartedLocked() {
+  if (running_) {
+    return;
+  }
+  running_ = true;
+  thread_ = std::thread([this]() { Run(); });
+}
+
+void EventLoop::Wakeup() {
+#ifdef __linux__
+  if (wake_fd_ >= 0) {
+    uint64_t one = 1;
+    ssize_t n = write(wake_fd_, &one, sizeof(one));
+    (void)n;
+  }
+#else
+  cond_.notify_one();
+#endif
+}
+
+EventLoop::TaskId EventLoop::PostDelayed(std::chrono::milliseconds delay, Task task) {
+  TaskId id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    id = ++next_id_;
+    timers_.emplace(Clock::now() + delay, std::make_pair(id, std::move(task)));
+    EnsureStartedLocked();
+  }
+  Wakeup();
+  return id;
+}
+
+bool EventLoop::Cancel(TaskId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = timers_.begin(); it != timers_.end(); ++it) {
+    if (it->second.first == id) {
+      timers_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef __linux__
+void EventLoop::WatchFd(int fd, std::function<void(int)> callback) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    watchers_[fd] = std::move(callback);
+    EnsureStartedLocked();
+  }
+  Wakeup();
+}
+
+void EventLoop::UnwatchFd(int fd) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    watchers_.erase(fd);
+  }
+  Wakeup();
+}
+#endif
+
+void EventLoop::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    auto now = Clock::now();
+    if (!timers_.empty() && timers_.begin()->first <= now) {
+      auto task = std::move(timers_.begin()->second.second);
+      timers_.erase(timers_.begin());
+      lock.unlock();
+      task();
+      lock.lock();
+      continue;
+    }
+
+#ifdef __linux__
+    int timeout_ms = -1;
+    if (!timers_.empty()) {
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers_.begin()->first - now);
+      timeout_ms = static_cast<int>(wait.count());
+    }
+    std::vector<pollfd> fds;
+    fds.reserve(watchers_.size() + 1);
+    fds.push_back({wake_fd_, POLLIN, 0});
+    for (const auto& watcher : watchers_) {
+      fds.push_back({watcher.first, POLLIN, 0});
+    }
+
+    lock.unlock();
+    int n = poll(fds.data(), fds.size(), timeout_ms);
+    if (n > 0 && (fds[0].revents & POLLIN)) {
+      uint64_t value;
+      ssize_t r = read(wake_fd_, &value, sizeof(value));
+      (void)r;
+    }
+    lock.lock();
+
+    for (size_t i = 1; n > 0 && i < fds.size() && running_; ++i) {
+      if (!(fds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+        continue;
+      }
+      auto it = watchers_.find(fds[i].fd);
+      if (it == watchers_.end()) {
+        continue;  // unwatched while polling
+      }
+      auto callback = it->second;
+      lock.unlock();
+      callback(fds[i].fd);
+      lock.lock();
+    }
+#else
+    if (timers_.empty()) {
+      cond_.wait(lock);
+    } else {
+      cond_.wait_until(lock, timers_.begin()->first);
+    }
+#endif
+  }
+}
+
+}  // namespace copilot
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace copilot {
+
+// 共享的后台线程：定时任务 + (Linux) fd 可读事件。
+// 线程在第一次注册任务时才启动；没有任务时阻塞等待，不产生周期唤醒。
+class EventLoop {
+ public:
+  using Task = std::function<void()>;
+  using TaskId = uint64_t;
+  using Clock = std::chrono::steady_clock;
+
+  static EventLoop& Instance();
+
+  TaskId Post(Task task) { return PostDelayed(std::chrono::milliseconds(0), std::move(task)); }
+  TaskId PostDelayed(std::chrono::milliseconds delay, Task task);
+  // 取消尚未执行的任务，返回是否取消成功
+  bool Cancel(TaskId id);
+
+#ifdef __linux__
+  // fd 可读时在后台线程回调（fd 需为非阻塞）
+  void WatchFd(int fd, std::function<void(int)> callback);
+  void UnwatchFd(int fd);
+#endif
+
+ private:
+  EventLoop();
+  ~EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  void EnsureStartedLocked();
+  void Wakeup();
+  void Run();
+
+  std::mutex mutex_;
+  std::thread thread_;
+  bool running_ = false;
+  TaskId next_id_ = 0;
+  std::multimap<Clock::time_point, std::pair<TaskId, Task>> timers_;
+#ifdef __linux__
+  int wake_fd_ = -1;
+  std::unordered_map<int, std::function<void(int)>> watchers_;
+#else
+  std::condition_variable cond_;
+#endif
+};
+
+}  // namespace copilot
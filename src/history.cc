@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <string>
 #include <unordered_set>
 
@@ -112,6 +113,20 @@ inline std::vector<size_t> SplitU8(const std::string& input) {
 }  // namespace
 
 namespace copilot {
+bool IsPunct(std::string_view text) {
+  static const std::string_view kPunct[] = {"，", "。", "！", "？", "；", "：", "、", "…",
+                                            "“",  "”",  "（", "）", "《", "》", "·"};
+  if (text.empty()) {
+    return false;
+  }
+  auto c = text.substr(0, Utf8Len(text[0]));
+  if (c.size() == 1) {
+    return std::isspace(static_cast<unsigned char>(c[0])) ||
+           std::ispunct(static_cast<unsigned char>(c[0]));
+  }
+  return std::find(std::begin(kPunct), std::end(kPunct), c) != std::end(kPunct);
+}
+
 UTF8::UTF8(const std::string& data) {
   data_ = data;
   auto lens = SplitU8(data);  // 每个字符的长度
@@ -290,6 +305,21 @@ std::string History::gets(size_t n) const {
   return input_.substr(input_.size() - pos);
 }
 
+std::vector<std::string> History::entries(size_t n) const {
+  size_t skip = (n >= pos_.size()) ? 0 : pos_.size() - n;
+  size_t pos = input_.size();
+  for (size_t i = skip; i < pos_.size(); ++i) {
+    pos -= pos_[i].total;
+  }
+  std::vector<std::string> result;
+  result.reserve(pos_.size() - skip);
+  for (size_t i = skip; i < pos_.size(); ++i) {
+    result.emplace_back(input_.substr(pos, pos_[i].total));
+    pos += pos_[i].total;
+  }
+  return result;
+}
+
 std::string History::get_chars(size_t n) const {
   if (pos_.empty()) {
     return "";
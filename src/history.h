@@ -7,6 +7,17 @@
 
 namespace copilot {
 
+// 以 c 开头的 UTF-8 字符的字节数；非法首字节按 1 字节算
+inline size_t Utf8Len(unsigned char c) {
+  if ((c & 0xE0) == 0xC0) return 2;
+  if ((c & 0xF0) == 0xE0) return 3;
+  if ((c & 0xF8) == 0xF0) return 4;
+  return 1;
+}
+
+// text 的第一个字符是空白或标点（ASCII 及常用全角标点）
+bool IsPunct(std::string_view text);
+
 class UTF8 {
  public:
   explicit UTF8(const std::string& data);
@@ -36,6 +47,8 @@ class History {
   bool empty() const { return pos_.empty(); }
   std::string back() const;
   std::string gets(size_t n) const;
+  // 最近 n 条记录，逐条返回（拼起来等于 gets(n)）
+  std::vector<std::string> entries(size_t n) const;
   std::string get_chars(size_t n) const;
 
   std::string_view last() const;
@@ -4,6 +4,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <rime/context.h>
 #include <rime/engine.h>
 #include <rime/schema.h>
@@ -190,6 +192,8 @@ void ImeBridgeServer::ProcessMessage(const std::string& message) {
     }
 
     TouchClient(client_key);
+    // 先消化该客户端 ring 中已发布的记录，保证与 JSON action 的发送顺序一致
+    DrainShmChannel(client_key);
 
     if (action == "set") {
       bool ascii = data.value("ascii", true);
@@ -208,13 +212,23 @@ void ImeBridgeServer::ProcessMessage(const std::string& message) {
       HandleContext(client_key, before, after);
     } else if (action == "clear_context") {
       HandleClearContext(client_key);
+    } else if (action == "document") {
+      HandleDocument(client_key, data.value("offset", size_t(0)), data.value("text", ""),
+                     data.value("cursor", int64_t(-1)), data.value("reset", false));
     } else if (action == "activate") {
       HandleActivate(client_key);
     } else if (action == "deactivate") {
       HandleDeactivate(client_key);
+    } else if (action == "attach_shm") {
+      HandleAttachShm(client_key, data.value("name", ""));
+    } else if (action == "detach_shm") {
+      HandleDetachShm(client_key);
     } else if (action == "ping") {
       if (config_.debug) {
-        LOG(INFO) << "[ImeBridge] Ping received from " << client_key;
+        auto stats = GetStats();
+        LOG(INFO) << "[ImeBridge] Ping received from " << client_key
+                  << ", enqueued=" << stats.enqueued << ", coalesced=" << stats.coalesced
+                  << ", dropped=" << stats.dropped;
       }
     } else {
       LOG(WARNING) << "[ImeBridge] Unknown action: " << action;
@@ -249,7 +263,7 @@ void ImeBridgeServer::HandleSet(const std::string& client_key, bool ascii, bool
   action.client_key = client_key;
   action.ascii = ascii;
   action.stack = stack;
-  pending_actions_.push(action);
+  EnqueueActionLocked(std::move(action));
 
   if (config_.debug) {
     LOG(INFO) << "[ImeBridge] HandleSet: client=" << client_key << ", ascii=" << ascii
@@ -261,8 +275,9 @@ void ImeBridgeServer::HandleSet(const std::string& client_key, bool ascii, bool
 void ImeBridgeServer::HandleRestore(const std::string& client_key) {
   std::lock_guard<std::mutex> lock(mutex_);
 
-  auto it = client_states_.find(client_key);
-  if (it == client_states_.end() || it->second.depth == 0) {
+  // 使用排队后的 depth 判断：set 尚未被应用时紧跟的 restore 不能被丢弃
+  int depth = ProjectedDepthLocked(client_key);
+  if (depth == 0) {
     if (config_.debug) {
       LOG(INFO) << "[ImeBridge] HandleRestore: no state to restore for " << client_key;
     }
@@ -272,11 +287,11 @@ void ImeBridgeServer::HandleRestore(const std::string& client_key) {
   ImeBridgePendingAction action;
   action.type = ImeBridgePendingAction::kRestore;
   action.client_key = client_key;
-  pending_actions_.push(action);
+  EnqueueActionLocked(std::move(action));
 
   if (config_.debug) {
-    LOG(INFO) << "[ImeBridge] HandleRestore: client=" << client_key
-              << ", depth=" << it->second.depth << ", queue_size=" << pending_actions_.size();
+    LOG(INFO) << "[ImeBridge] HandleRestore: client=" << client_key << ", depth=" << depth
+              << ", queue_size=" << pending_actions_.size();
   }
 }
 
@@ -287,7 +302,7 @@ void ImeBridgeServer::HandleReset(const std::string& client_key, bool restore) {
   action.type = ImeBridgePendingAction::kReset;
   action.client_key = client_key;
   action.restore = restore;
-  pending_actions_.push(action);
+  EnqueueActionLocked(std::move(action));
 
   if (config_.debug) {
     LOG(INFO) << "[ImeBridge] HandleReset: client=" << client_key << ", restore=" << restore;
@@ -296,11 +311,12 @@ void ImeBridgeServer::HandleReset(const std::string& client_key, bool restore) {
 
 void ImeBridgeServer::HandleUnregister(const std::string& client_key) {
   std::lock_guard<std::mutex> lock(mutex_);
+  shm_channels_.erase(client_key);
 
   ImeBridgePendingAction action;
   action.type = ImeBridgePendingAction::kUnregister;
   action.client_key = client_key;
-  pending_actions_.push(action);
+  EnqueueActionLocked(std::move(action));
 
   if (config_.debug) {
     LOG(INFO) << "[ImeBridge] HandleUnregister: client=" << client_key;
@@ -329,6 +345,7 @@ void ImeBridgeServer::HandleClearContext(const std::string& client_key) {
     it->second.context_valid = false;
     it->second.char_before.clear();
     it->second.char_after.clear();
+    it->second.document.reset();
     it->second.last_active = std::chrono::steady_clock::now();
     if (active_client_ == client_key) {
       active_client_.clear();
@@ -340,6 +357,31 @@ void ImeBridgeServer::HandleClearContext(const std::string& client_key) {
   }
 }
 
+void ImeBridgeServer::HandleDocument(const std::string& client_key, size_t offset,
+                                     const std::string& text, int64_t cursor, bool reset) {
+  if (config_.max_document_bytes <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& state = client_states_[client_key];
+  state.last_active = std::chrono::steady_clock::now();
+  if (!state.document) {
+    state.document = std::make_shared<DocumentIndex>(config_.max_document_bytes);
+  }
+  auto& document = *state.document;
+  if (reset) {
+    document.Reset();
+  }
+  bool in_window = document.Update(offset, text);
+  document.set_cursor(cursor < 0 ? std::string::npos : size_t(cursor));
+
+  if (config_.debug) {
+    LOG(INFO) << "[ImeBridge] HandleDocument: client=" << client_key << ", offset=" << offset
+              << ", bytes=" << text.size() << ", window=[" << document.base() << ", "
+              << document.end() << ")" << (in_window ? "" : ", rebased");
+  }
+}
+
 void ImeBridgeServer::HandleActivate(const std::string& client_key) {
   std::lock_guard<std::mutex> lock(mutex_);
   auto& state = client_states_[client_key];
@@ -364,15 +406,338 @@ void ImeBridgeServer::HandleDeactivate(const std::string& client_key) {
   }
 }
 
+void ImeBridgeServer::HandleAttachShm(const std::string& client_key, const std::string& name) {
+  if (!config_.enable_shm) {
+    LOG(WARNING) << "[ImeBridge] attach_shm ignored (disabled): client=" << client_key;
+    return;
+  }
+  // 在锁外完成 shm_open/mmap
+  auto channel = std::make_unique<ImeBridgeShmChannel>();
+  if (!channel->Open(name)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& state = client_states_[client_key];
+  state.last_active = std::chrono::steady_clock::now();
+  shm_channels_[client_key] = std::move(channel);
+  if (config_.debug) {
+    LOG(INFO) << "[ImeBridge] HandleAttachShm: client=" << client_key << ", name=" << name;
+  }
+}
+
+void ImeBridgeServer::HandleDetachShm(const std::string& client_key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = shm_channels_.find(client_key);
+  if (it == shm_channels_.end()) {
+    return;
+  }
+  if (config_.debug) {
+    LOG(INFO) << "[ImeBridge] HandleDetachShm: client=" << client_key
+              << ", skipped=" << it->second->skipped();
+  }
+  shm_channels_.erase(it);
+}
+
+void ImeBridgeServer::PollShmChannelsLocked() {
+  for (auto it = shm_channels_.begin(); it != shm_channels_.end();) {
+    it = PollShmChannelLocked(it);
+  }
+}
+
+void ImeBridgeServer::DrainShmChannel(const std::string& client_key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = shm_channels_.find(client_key);
+  if (it != shm_channels_.end()) {
+    PollShmChannelLocked(it);
+  }
+}
+
+ImeBridgeServer::ShmChannelMap::iterator ImeBridgeServer::PollShmChannelLocked(
+    ShmChannelMap::iterator it) {
+  const std::string& client_key = it->first;
+  auto& channel = it->second;
+  ImeBridgeShmChannel::Latest latest;
+  if (!channel->Poll(&latest)) {
+    // Poll 发现对象被截短时会关闭通道
+    return channel->IsOpen() ? std::next(it) : shm_channels_.erase(it);
+  }
+  auto& state = client_states_[client_key];
+  state.last_active = std::chrono::steady_clock::now();
+  if (latest.has_context) {
+    if (latest.clear_context) {
+      state.context_valid = false;
+      state.char_before.clear();
+      state.char_after.clear();
+      if (active_client_ == client_key) {
+        active_client_.clear();
+      }
+    } else {
+      state.char_before = std::move(latest.before);
+      state.char_after = std::move(latest.after);
+      state.context_valid = true;
+    }
+  }
+  if (latest.has_ascii) {
+    state.current_target = latest.ascii;
+    ImeBridgePendingAction action;
+    action.type = ImeBridgePendingAction::kSet;
+    action.client_key = client_key;
+    action.ascii = latest.ascii;
+    action.stack = false;
+    EnqueueActionLocked(std::move(action));
+  }
+  return std::next(it);
+}
+
+int ImeBridgeServer::ProjectedDepthLocked(const std::string& client_key) const {
+  int depth = 0;
+  auto it = client_states_.find(client_key);
+  if (it != client_states_.end()) {
+    depth = it->second.depth;
+  }
+  for (const auto& action : pending_actions_) {
+    if (action.client_key != client_key) {
+      continue;
+    }
+    switch (action.type) {
+      case ImeBridgePendingAction::kSet:
+        depth += action.stack ? 1 : 0;
+        break;
+      case ImeBridgePendingAction::kRestore:
+        depth = std::max(0, depth - 1);
+        break;
+      case ImeBridgePendingAction::kReset:
+      case ImeBridgePendingAction::kUnregister:
+        depth = 0;
+        break;
+      default:
+        break;
+    }
+  }
+  return depth;
+}
+
+void ImeBridgeServer::EnqueueActionLocked(ImeBridgePendingAction action) {
+  ++stats_.enqueued;
+  const std::string& key = action.client_key;
+  auto last_of_client = [this, &key]() {
+    auto it = pending_actions_.end();
+    while (it != pending_actions_.begin()) {
+      --it;
+      if (it->client_key == key) {
+        return it;
+      }
+    }
+    return pending_actions_.end();
+  };
+
+  auto last = last_of_client();
+  switch (action.type) {
+    case ImeBridgePendingAction::kSet:
+      // set(a) + set(b, stack=false) => set(b)，保留前者的 stack 语义
+      if (!action.stack && last != pending_actions_.end() &&
+          last->type == ImeBridgePendingAction::kSet) {
+        last->ascii = action.ascii;
+        ++stats_.coalesced;
+        return;
+      }
+      break;
+
+    case ImeBridgePendingAction::kRestore:
+      while (last != pending_actions_.end() && last->type == ImeBridgePendingAction::kSet) {
+        int depth = ProjectedDepthLocked(key);
+        if (last->stack) {
+          auto state = client_states_.find(key);
+          bool has_initial = state != client_states_.end() && state->second.has_initial;
+          if (depth == 1 && has_initial) {
+            // set(stack) + restore 回到 base，二者抵消
+            pending_actions_.erase(last);
+            --queue_counts_[key].size;
+            stats_.coalesced += 2;
+            return;
+          }
+          if (depth > 1) {
+            // 未回到 base：等价于一次不入栈的 set
+            last->stack = false;
+            ++stats_.coalesced;
+            return;
+          }
+          break;
+        }
+        if (depth != 1) {
+          break;
+        }
+        // restore 会回到 base，覆盖之前不入栈的 set
+        pending_actions_.erase(last);
+        --queue_counts_[key].size;
+        ++stats_.coalesced;
+        last = last_of_client();
+      }
+      break;
+
+    case ImeBridgePendingAction::kReset:
+      // reset(restore=true) 回到初始状态并清除 client 状态，之前的 action 均无效；
+      // 但 unregister 是屏障，它及其之前的 action 必须保留
+      if (action.restore) {
+        auto begin = pending_actions_.end();
+        while (begin != pending_actions_.begin()) {
+          auto prev = std::prev(begin);
+          if (prev->client_key == key && prev->type == ImeBridgePendingAction::kUnregister) {
+            break;
+          }
+          begin = prev;
+        }
+        auto end = std::remove_if(
+            begin, pending_actions_.end(),
+            [&key](const ImeBridgePendingAction& a) { return a.client_key == key; });
+        size_t removed = std::distance(end, pending_actions_.end());
+        stats_.coalesced += removed;
+        queue_counts_[key].size -= removed;
+        pending_actions_.erase(end, pending_actions_.end());
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  auto& count = queue_counts_[key];
+  ++count.size;
+  pending_actions_.push_back(std::move(action));
+
+  // 每个 client 的队列有上限，超出时把该 client 的队列折叠为净效果。
+  // 折叠后仍超限（例如多层入栈）时，待队列再翻倍才重新折叠，避免每次入队都扫描整个队列
+  size_t limit = std::max(1, config_.max_pending_actions);
+  if (count.size > std::max(limit, count.collapse_at)) {
+    CollapseActionsLocked(key);
+    count.collapse_at = 2 * count.size;
+  }
+}
+
+void ImeBridgeServer::CollapseActionsLocked(const std::string& key) {
+  using Action = ImeBridgePendingAction;
+  // 模拟一段（以 reset / unregister 分隔）set / restore 的效果。
+  // 未知的 ascii 值（应用时的当前状态）用 nullopt 表示
+  struct Segment {
+    int start = 0;
+    int depth = 0;
+    int min_depth = 0;
+    std::optional<bool> base;
+    std::optional<bool> cur;
+    std::optional<bool> cur_at_min;  // 最后一次处于 min_depth 时的状态
+    bool empty = true;
+
+    void Reset(int d, std::optional<bool> b) {
+      *this = Segment{};
+      start = depth = min_depth = d;
+      base = b;
+    }
+    void Feed(const Action& a) {
+      empty = false;
+      if (a.type == Action::kSet) {
+        if (a.stack) {
+          if (depth == 0) {
+            base = cur;
+          }
+          ++depth;
+        }
+        cur = a.ascii;
+      } else if (depth > 0) {  // kRestore
+        if (--depth == 0) {
+          cur = base;
+        }
+      }
+      if (depth <= min_depth) {
+        min_depth = depth;
+        cur_at_min = cur;
+      }
+    }
+    // 净效果：先 restore 到最浅处，再设为当时的状态，最后按剩余的层数入栈
+    void Emit(const std::string& key, std::deque<Action>* out) const {
+      if (empty) {
+        return;
+      }
+      Action a;
+      a.client_key = key;
+      a.type = Action::kRestore;
+      for (int i = min_depth; i < start; ++i) {
+        out->push_back(a);
+      }
+      a.type = Action::kSet;
+      if (cur_at_min) {
+        a.ascii = *cur_at_min;
+        a.stack = false;
+        out->push_back(a);
+      }
+      for (int i = min_depth; i < depth; ++i) {
+        a.ascii = cur.value_or(a.ascii);
+        a.stack = true;
+        out->push_back(a);
+      }
+    }
+  };
+
+  Segment segment;
+  auto state = client_states_.find(key);
+  if (state != client_states_.end()) {
+    const auto& s = state->second;
+    segment.Reset(s.depth, s.has_base ? std::optional<bool>(s.base) : std::nullopt);
+  }
+  size_t before = pending_actions_.size();
+  std::deque<Action> collapsed;
+  for (auto it = pending_actions_.begin(); it != pending_actions_.end(); ++it) {
+    if (it->client_key != key) {
+      collapsed.push_back(std::move(*it));
+      continue;
+    }
+    switch (it->type) {
+      case Action::kSet:
+      case Action::kRestore:
+        segment.Feed(*it);
+        break;
+      case Action::kReset:
+      case Action::kUnregister:
+        // 控制 action 永不丢弃；之前的 set / restore 折叠后放在它前面
+        segment.Emit(key, &collapsed);
+        collapsed.push_back(std::move(*it));
+        segment.Reset(0, std::nullopt);
+        break;
+      default:
+        collapsed.push_back(std::move(*it));
+        break;
+    }
+  }
+  segment.Emit(key, &collapsed);
+  pending_actions_.swap(collapsed);
+  queue_counts_[key].size = std::count_if(
+      pending_actions_.begin(), pending_actions_.end(),
+      [&key](const Action& a) { return a.client_key == key; });
+  if (pending_actions_.size() < before) {
+    stats_.coalesced += before - pending_actions_.size();
+  }
+  if (config_.debug) {
+    LOG(INFO) << "[ImeBridge] collapsed pending actions of " << key << ": " << before << " -> "
+              << pending_actions_.size();
+  }
+}
+
 std::queue<ImeBridgePendingAction> ImeBridgeServer::TakePendingActions() {
   std::lock_guard<std::mutex> lock(mutex_);
-  std::queue<ImeBridgePendingAction> result;
-  std::swap(result, pending_actions_);
+  PollShmChannelsLocked();
+  std::queue<ImeBridgePendingAction> result(std::move(pending_actions_));
+  pending_actions_.clear();
+  queue_counts_.clear();
   return result;
 }
 
+ImeBridgeServer::Stats ImeBridgeServer::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
 std::optional<SurroundingText> ImeBridgeServer::GetActiveContext() {
   std::lock_guard<std::mutex> lock(mutex_);
+  PollShmChannelsLocked();
 
   if (active_client_.empty()) {
     return std::nullopt;
@@ -388,6 +753,22 @@ std::optional<SurroundingText> ImeBridgeServer::GetActiveContext() {
   return SurroundingText{it->second.char_before, it->second.char_after, active_client_};
 }
 
+std::string ImeBridgeServer::GetActiveClient() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return active_client_;
+}
+
+std::vector<DocumentIndex::Match> ImeBridgeServer::CompleteFromDocument(const std::string& context,
+                                                                        size_t max_results,
+                                                                        size_t max_chars) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = client_states_.find(active_client_);
+  if (active_client_.empty() || it == client_states_.end() || !it->second.document) {
+    return {};
+  }
+  return it->second.document->Complete(context, max_results, max_chars);
+}
+
 void ImeBridgeServer::CleanupStaleClients() {
   auto now = std::chrono::steady_clock::now();
 
@@ -414,6 +795,7 @@ void ImeBridgeServer::CleanupStaleClients() {
         LOG(INFO) << "[ImeBridge] Removing stale client: " << key;
       }
       client_states_.erase(key);
+      shm_channels_.erase(key);
     }
   }
 }
@@ -562,6 +944,9 @@ ImeBridge::ImeBridge(const Ticket& ticket) : CopilotPlugin<ImeBridge>(ticket) {
     config->GetString("copilot/ime_bridge/socket_path", &config_.socket_path);
     config->GetBool("copilot/ime_bridge/debug", &config_.debug);
     config->GetInt("copilot/ime_bridge/client_timeout_minutes", &config_.client_timeout_minutes);
+    config->GetBool("copilot/ime_bridge/enable_shm", &config_.enable_shm);
+    config->GetInt("copilot/ime_bridge/max_pending_actions", &config_.max_pending_actions);
+    config->GetInt("copilot/ime_bridge/max_document_bytes", &config_.max_document_bytes);
   }
 
   if (config_.enable) {
@@ -4,6 +4,7 @@
 #include <chrono>
 #include <memory>
 #include <mutex>
+#include <deque>
 #include <optional>
 #include <queue>
 #include <string>
@@ -11,6 +12,8 @@
 #include <unordered_map>
 
 #include "copilot_plugin.h"
+#include "document_index.h"
+#include "ime_bridge_shm.h"
 #include "imk_client.h"
 
 namespace rime {
@@ -31,6 +34,9 @@ struct ImeBridgeClientState {
   std::string char_before;
   std::string char_after;
   bool context_valid = false;
+
+  // 编辑器文档窗口（document action）
+  std::shared_ptr<DocumentIndex> document;
 };
 
 // 待处理的 action
@@ -63,6 +69,16 @@ class ImeBridgeServer {
     std::string socket_path = "/tmp/rime_copilot_ime.sock";
     bool debug = false;
     int client_timeout_minutes = 30;
+    bool enable_shm = true;  // allow clients to attach shared-memory rings
+    int max_pending_actions = 32;  // per-client bound of the pending queue
+    int max_document_bytes = 65536;  // per-client document window, 0 disables `document`
+  };
+
+  // 队列统计（合并 / 丢弃计数）
+  struct Stats {
+    uint64_t enqueued = 0;
+    uint64_t coalesced = 0;  // actions folded into an already queued one (or cancelled)
+    uint64_t dropped = 0;    // superseded context updates dropped by the per-client bound
   };
 
   // ApplyAction 返回值
@@ -83,10 +99,18 @@ class ImeBridgeServer {
 
   // 获取活跃客户端的上下文信息（线程安全）
   std::optional<SurroundingText> GetActiveContext();
+  // 当前活跃客户端的 key（"app:instance"），没有时为空（线程安全）
+  std::string GetActiveClient() const;
+  // 在活跃客户端的文档中查找 context 末尾之后的文本（线程安全）
+  std::vector<DocumentIndex::Match> CompleteFromDocument(const std::string& context,
+                                                         size_t max_results,
+                                                         size_t max_chars) const;
 
   // 获取待处理的 actions（线程安全）
   std::queue<ImeBridgePendingAction> TakePendingActions();
 
+  Stats GetStats() const;
+
   // 应用单个 action，返回需要设置的 ascii_mode（带状态跟踪）
   ApplyResult ApplyAction(const ImeBridgePendingAction& action, bool current_ascii);
 
@@ -108,10 +132,29 @@ class ImeBridgeServer {
   void HandleContext(const std::string& client_key, const std::string& before,
                      const std::string& after);
   void HandleClearContext(const std::string& client_key);
+  void HandleDocument(const std::string& client_key, size_t offset, const std::string& text,
+                      int64_t cursor, bool reset);
   void HandleActivate(const std::string& client_key);
   void HandleDeactivate(const std::string& client_key);
+  void HandleAttachShm(const std::string& client_key, const std::string& name);
+  void HandleDetachShm(const std::string& client_key);
   void TouchClient(const std::string& client_key);
 
+  using ShmChannelMap = std::unordered_map<std::string, std::unique_ptr<ImeBridgeShmChannel>>;
+
+  // 读取各客户端共享内存中的最新记录（调用方需持有 mutex_）
+  void PollShmChannelsLocked();
+  // 读取一个客户端的记录，返回下一个通道；通道失效时将其移除（调用方需持有 mutex_）
+  ShmChannelMap::iterator PollShmChannelLocked(ShmChannelMap::iterator it);
+  // 在应用该客户端的 JSON action 前读取其 ring 中已发布的记录
+  void DrainShmChannel(const std::string& client_key);
+  // 入队并与该客户端已排队的 action 合并为净效果（调用方需持有 mutex_）
+  void EnqueueActionLocked(ImeBridgePendingAction action);
+  // 超出上限时把该客户端的 set / restore 折叠为净效果，控制 action 保持原样（调用方需持有 mutex_）
+  void CollapseActionsLocked(const std::string& client_key);
+  // 该客户端应用完所有排队 action 后的 depth（调用方需持有 mutex_）
+  int ProjectedDepthLocked(const std::string& client_key) const;
+
   static std::string MakeClientKey(const std::string& app, const std::string& instance);
 
   Config config_;
@@ -123,7 +166,15 @@ class ImeBridgeServer {
   mutable std::mutex mutex_;
   std::unordered_map<std::string, ImeBridgeClientState> client_states_;
   std::string active_client_;
-  std::queue<ImeBridgePendingAction> pending_actions_;
+  std::deque<ImeBridgePendingAction> pending_actions_;
+  // 每个 client 在 pending_actions_ 中的数量，以及下一次折叠的阈值
+  struct QueueCount {
+    size_t size = 0;
+    size_t collapse_at = 0;
+  };
+  std::unordered_map<std::string, QueueCount> queue_counts_;
+  Stats stats_;
+  ShmChannelMap shm_channels_;
   std::chrono::steady_clock::time_point last_cleanup_;
 };
 
@@ -0,0 +1,164 @@
+#include "ime_bridge_shm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+
+namespace rime {
+
+namespace {
+
+constexpr const char* kShmNamePrefix = "/rime_ime.";
+
+// Only accept names created for this purpose; never map arbitrary objects.
+inline bool IsValidShmName(const std::string& name) {
+  if (name.compare(0, std::strlen(kShmNamePrefix), kShmNamePrefix) != 0) {
+    return false;
+  }
+  return name.size() < 255 && name.find('/', 1) == std::string::npos;
+}
+
+}  // namespace
+
+ImeBridgeShmChannel::~ImeBridgeShmChannel() { Close(); }
+
+bool ImeBridgeShmChannel::Open(const std::string& name) {
+  Close();
+  if (!IsValidShmName(name)) {
+    LOG(WARNING) << "[ImeBridge] Rejected shm name: '" << name << "'";
+    return false;
+  }
+
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    LOG(WARNING) << "[ImeBridge] shm_open failed for " << name << ": " << strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid() ||
+      size_t(st.st_size) < sizeof(ImeBridgeShmHeader)) {
+    LOG(WARNING) << "[ImeBridge] Invalid shm object: " << name;
+    close(fd);
+    return false;
+  }
+  size_t size = size_t(st.st_size);
+  void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    LOG(WARNING) << "[ImeBridge] mmap failed for " << name << ": " << strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  const auto* header = static_cast<const ImeBridgeShmHeader*>(address);
+  uint16_t capacity = header->capacity;
+  bool valid = header->magic == kImeBridgeShmMagic && header->version == kImeBridgeShmVersion &&
+               header->record_size == sizeof(ImeBridgeShmRecord) && capacity > 0 &&
+               capacity <= kImeBridgeShmMaxCapacity && (capacity & (capacity - 1)) == 0 &&
+               size >= ImeBridgeShmSize(capacity);
+  if (!valid) {
+    LOG(WARNING) << "[ImeBridge] Bad shm header in " << name;
+    munmap(address, size);
+    close(fd);
+    return false;
+  }
+
+  // fd 保留到 Close()，Poll 时用它确认对象没有被客户端截短
+  name_ = name;
+  fd_ = fd;
+  address_ = address;
+  size_ = size;
+  header_ = header;
+  records_ = reinterpret_cast<const ImeBridgeShmRecord*>(header + 1);
+  mask_ = capacity - 1;
+  last_seq_ = 0;
+  skipped_ = 0;
+  return true;
+}
+
+void ImeBridgeShmChannel::Close() {
+  if (address_) {
+    munmap(address_, size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  fd_ = -1;
+  address_ = nullptr;
+  size_ = 0;
+  header_ = nullptr;
+  records_ = nullptr;
+  name_.clear();
+}
+
+bool ImeBridgeShmChannel::Poll(Latest* latest) {
+  if (!header_) {
+    return false;
+  }
+  // A client that ftruncate()s the object below the ring would make any read
+  // of the mapping raise SIGBUS in the IME process; detach instead.
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || size_t(st.st_size) < ImeBridgeShmSize(uint16_t(mask_ + 1))) {
+    LOG(WARNING) << "[ImeBridge] shm object shrank, detaching: " << name_;
+    Close();
+    return false;
+  }
+  uint64_t head = header_->write_seq.load(std::memory_order_acquire);
+  if (head < last_seq_) {
+    last_seq_ = 0;  // client re-initialized its ring
+  }
+  if (head == last_seq_) {
+    return false;
+  }
+
+  // Walk backwards from the newest record; older ones are superseded anyway.
+  uint64_t floor = head > mask_ + 1 ? head - (mask_ + 1) : 0;
+  floor = std::max(floor, last_seq_);
+  bool want_context = true;
+  bool want_ascii = true;
+  uint64_t consumed = 0;
+  for (uint64_t s = head; s > floor && (want_context || want_ascii); --s) {
+    const auto& slot = records_[(s - 1) & mask_];
+    uint64_t version = slot.seq.load(std::memory_order_acquire);
+    if (version != 2 * s) {
+      continue;  // being rewritten by a newer lap
+    }
+    uint8_t type = slot.type;
+    uint8_t ascii = slot.ascii;
+    uint8_t before_len = std::min<uint8_t>(slot.before_len, kImeBridgeShmTextSize);
+    uint8_t after_len = std::min<uint8_t>(slot.after_len, kImeBridgeShmTextSize);
+    char before[kImeBridgeShmTextSize];
+    char after[kImeBridgeShmTextSize];
+    std::memcpy(before, slot.before, before_len);
+    std::memcpy(after, slot.after, after_len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != version) {
+      continue;  // torn read
+    }
+
+    if (want_context && (type == kShmRecordContext || type == kShmRecordClearContext)) {
+      want_context = false;
+      ++consumed;
+      latest->has_context = true;
+      latest->clear_context = (type == kShmRecordClearContext);
+      latest->before.assign(before, before_len);
+      latest->after.assign(after, after_len);
+    } else if (want_ascii && type == kShmRecordAscii) {
+      want_ascii = false;
+      ++consumed;
+      latest->has_ascii = true;
+      latest->ascii = ascii != 0;
+    }
+  }
+  skipped_ += (head - last_seq_) - consumed;
+  last_seq_ = head;
+  return consumed > 0;
+}
+
+}  // namespace rime
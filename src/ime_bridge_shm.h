@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace rime {
+
+// Shared-memory ring for high-frequency ImeBridge updates.
+//
+// A client creates a POSIX shared memory object (`shm_open`), sizes it to
+// `ImeBridgeShmSize(capacity)`, fills in the header and announces it over the
+// JSON socket with `{"action":"attach_shm","name":"/rime_ime.<...>"}`. From then
+// on it publishes `context`/`ascii` records into the ring without any syscall;
+// the server reads only the newest record of each type when it needs them.
+//
+// Writer protocol (single producer per ring):
+//   s = write_seq + 1; slot = records[(s - 1) % capacity]
+//   slot.seq = 2 * s - 1 (release); write payload; slot.seq = 2 * s (release)
+//   write_seq = s (release)
+constexpr uint32_t kImeBridgeShmMagic = 0x454d4952;  // "RIME"
+constexpr uint16_t kImeBridgeShmVersion = 1;
+constexpr size_t kImeBridgeShmTextSize = 24;
+constexpr uint16_t kImeBridgeShmMaxCapacity = 1024;
+
+enum ImeBridgeShmRecordType : uint8_t {
+  kShmRecordNone = 0,
+  kShmRecordContext = 1,  // before/after surrounding text
+  kShmRecordAscii = 2,    // absolute ascii_mode, same as `set` with stack=false
+  kShmRecordClearContext = 3,
+};
+
+struct ImeBridgeShmHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t capacity;  // number of records, power of two
+  uint32_t record_size;
+  uint32_t reserved;
+  std::atomic<uint64_t> write_seq;
+  char padding[40];
+};
+
+struct ImeBridgeShmRecord {
+  std::atomic<uint64_t> seq;  // odd while being written
+  uint8_t type;
+  uint8_t ascii;
+  uint8_t before_len;
+  uint8_t after_len;
+  uint32_t reserved;
+  char before[kImeBridgeShmTextSize];
+  char after[kImeBridgeShmTextSize];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared ring needs lock-free atomics");
+static_assert(sizeof(ImeBridgeShmHeader) == 64, "unexpected ImeBridgeShmHeader layout");
+static_assert(sizeof(ImeBridgeShmRecord) == 64, "unexpected ImeBridgeShmRecord layout");
+
+inline size_t ImeBridgeShmSize(uint16_t capacity) {
+  return sizeof(ImeBridgeShmHeader) + size_t(capacity) * sizeof(ImeBridgeShmRecord);
+}
+
+// Server side view of one client's ring (read-only mapping).
+class ImeBridgeShmChannel {
+ public:
+  struct Latest {
+    bool has_context = false;
+    bool clear_context = false;
+    std::string before;
+    std::string after;
+    bool has_ascii = false;
+    bool ascii = false;
+  };
+
+  ImeBridgeShmChannel() = default;
+  ~ImeBridgeShmChannel();
+  ImeBridgeShmChannel(const ImeBridgeShmChannel&) = delete;
+  ImeBridgeShmChannel& operator=(const ImeBridgeShmChannel&) = delete;
+
+  // Maps and validates the shared memory object `name`.
+  bool Open(const std::string& name);
+  void Close();
+  bool IsOpen() const { return header_ != nullptr; }
+  const std::string& name() const { return name_; }
+
+  // Collects the newest unread record of each type. Returns false if nothing
+  // has been published since the last poll. Closes the channel if the client
+  // truncated the object below the ring size.
+  bool Poll(Latest* latest);
+
+  uint64_t skipped() const { return skipped_; }
+
+ private:
+  std::string name_;
+  int fd_ = -1;
+  void* address_ = nullptr;
+  size_t size_ = 0;
+  const ImeBridgeShmHeader* header_ = nullptr;
+  const ImeBridgeShmRecord* records_ = nullptr;
+  uint64_t mask_ = 0;
+  uint64_t last_seq_ = 0;
+  uint64_t skipped_ = 0;  // records overwritten or superseded before being read
+};
+
+}  // namespace rime
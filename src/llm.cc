@@ -1,24 +1,153 @@
 
+#include <algorithm>
+#include <cmath>
 #include <deque>
+#include <fstream>
 #include <future>
 #include <iostream>
 #include <list>
+#include <map>
 #include <string>
 #include <thread>
 #include <unordered_set>
 #include <vector>
 
+#include <glog/logging.h>
 #include <llama.h>
 // #include <sampling.h>
 
 #include "llm.h"
 
 namespace {
-llama_sampler* create_sampler(const ClientConfig& cfg) {
+using TokenMask = std::shared_ptr<const std::vector<llama_token>>;
+
+// CJK 文字、中日韩标点、全角字符以及引号 / 破折号 / 省略号 / 间隔号
+bool IsCJKCodepoint(uint32_t c) {
+  return (c >= 0x4E00 && c <= 0x9FFF) || (c >= 0x3400 && c <= 0x4DBF) ||
+         (c >= 0x20000 && c <= 0x2EBEF) || (c >= 0xF900 && c <= 0xFAFF) ||
+         (c >= 0x3000 && c <= 0x303F) || (c >= 0xFF00 && c <= 0xFFEF) ||
+         (c >= 0x2010 && c <= 0x2027) || c == 0x00B7;
+}
+
+// token 的文本能否出现在结果中。生僻字会被拆成几个 byte token，
+// 开头的续字节与末尾不完整的字符也保留
+bool IsAllowedPiece(std::string_view piece, bool allow_ascii) {
+  static constexpr std::string_view kAsciiPunct = ",.!?;:'\"()-";
+  size_t i = 0;
+  while (i < piece.size() && (static_cast<unsigned char>(piece[i]) & 0xC0) == 0x80) {
+    ++i;
+  }
+  while (i < piece.size()) {
+    unsigned char c = piece[i];
+    if (c < 0x80) {
+      bool ascii_ok = std::isalnum(c) || c == ' ' || kAsciiPunct.find(c) != kAsciiPunct.npos;
+      if (!allow_ascii || !ascii_ok) {
+        return false;
+      }
+      ++i;
+      continue;
+    }
+    int len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+    if (len == 0) {
+      return false;
+    }
+    if (i + len > piece.size()) {
+      return len > 2;  // CJK 都是 3 / 4 字节
+    }
+    uint32_t cp = c & (0xFF >> (len + 1));
+    for (int k = 1; k < len; ++k) {
+      unsigned char cc = piece[i + k];
+      if ((cc & 0xC0) != 0x80) {
+        return false;
+      }
+      cp = (cp << 6) | (cc & 0x3F);
+    }
+    if (!IsCJKCodepoint(cp)) {
+      return false;
+    }
+    i += len;
+  }
+  return i > 0;
+}
+
+// 按 token id 升序排列的可选 token
+TokenMask BuildVocabMask(const llama_vocab* vocab, VocabMask kind) {
+  if (kind == VocabMask::kNone) {
+    return nullptr;
+  }
+  const int64_t t_start_us = llama_time_us();
+  auto allowed = std::make_shared<std::vector<llama_token>>();
+  const int n_vocab = llama_vocab_n_tokens(vocab);
+  char buf[128];
+  for (llama_token id = 0; id < n_vocab; ++id) {
+    int n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
+    if (llama_vocab_is_eog(vocab, id) ||
+        (n > 0 && IsAllowedPiece(std::string_view(buf, n), kind == VocabMask::kCJKAscii))) {
+      allowed->push_back(id);
+    }
+  }
+  LOG(INFO) << "[LLM] vocab mask: " << allowed->size() << "/" << n_vocab << " tokens, built in "
+            << (llama_time_us() - t_start_us) / 1000 << " ms";
+  return allowed;
+}
+
+// 采样链第一级：只保留 mask 中的 token
+struct VocabMaskSampler {
+  TokenMask allowed;
+};
+
+llama_sampler* init_vocab_mask_sampler(const TokenMask& allowed);
+
+void vocab_mask_apply(llama_sampler* smpl, llama_token_data_array* cur_p) {
+  const auto& allowed = *static_cast<VocabMaskSampler*>(smpl->ctx)->allowed;
+  size_t n = 0;
+  if (!cur_p->sorted && cur_p->size > size_t(allowed.back()) &&
+      cur_p->data[allowed.back()].id == allowed.back()) {
+    // SampleRow 给出的候选按 token id 排列：直接按下标取，O(mask 大小)
+    for (llama_token id : allowed) {
+      cur_p->data[n++] = cur_p->data[id];
+    }
+  } else {
+    for (size_t i = 0; i < cur_p->size; ++i) {
+      if (std::binary_search(allowed.begin(), allowed.end(), cur_p->data[i].id)) {
+        cur_p->data[n++] = cur_p->data[i];
+      }
+    }
+  }
+  if (n > 0) {
+    cur_p->size = n;
+    cur_p->selected = -1;
+  }
+}
+
+const llama_sampler_i* vocab_mask_iface() {
+  static const llama_sampler_i iface = [] {
+    llama_sampler_i i{};
+    i.name = [](const llama_sampler*) { return "vocab-mask"; };
+    i.apply = vocab_mask_apply;
+    i.clone = [](const llama_sampler* smpl) {
+      return init_vocab_mask_sampler(static_cast<const VocabMaskSampler*>(smpl->ctx)->allowed);
+    };
+    i.free = [](llama_sampler* smpl) { delete static_cast<VocabMaskSampler*>(smpl->ctx); };
+    return i;
+  }();
+  return &iface;
+}
+
+llama_sampler* init_vocab_mask_sampler(const TokenMask& allowed) {
+  return llama_sampler_init(vocab_mask_iface(), new VocabMaskSampler{allowed});
+}
+
+llama_sampler* create_sampler(const ClientConfig& cfg, const TokenMask& mask = nullptr) {
   llama_sampler_chain_params params = llama_sampler_chain_default_params();
   params.no_perf = cfg.no_perf;
   llama_sampler* sampler = llama_sampler_chain_init(params);
 
+  // 先缩小候选集，后面的 penalty / top-k / top-p 都只处理保留下来的 token
+  if (mask && !mask->empty()) {
+    llama_sampler_chain_add(sampler, init_vocab_mask_sampler(mask));
+  }
+
   // 添加 repetition / freq / presence penalty（非默认时）
   if (cfg.penalty_repeat != 1.0f || cfg.penalty_freq != 0.0f || cfg.penalty_present != 0.0f) {
     llama_sampler_chain_add(sampler,
@@ -64,6 +193,95 @@ llama_sampler* create_sampler(const ClientConfig& cfg) {
 
   return sampler;
 }
+
+// 模型给 token 的对数概率（log_softmax(logits)[token]）
+float TokenLogProbability(llama_context* ctx, int32_t idx, llama_token token, int n_vocab) {
+  const float* logits = llama_get_logits_ith(ctx, idx);
+  if (!logits || token < 0 || token >= n_vocab) {
+    return -INFINITY;
+  }
+  float max = logits[0];
+  for (int i = 1; i < n_vocab; ++i) {
+    max = std::max(max, logits[i]);
+  }
+  double sum = 0;
+  for (int i = 0; i < n_vocab; ++i) {
+    sum += std::exp(logits[i] - max);
+  }
+  return float(logits[token] - max - std::log(sum));
+}
+
+// 用采样器链从一行 logits 中选出 token。probability 是它在采样器保留下来的候选（已应用词表掩码、
+// top-k 等）上的 softmax 概率，只遍历 apply 之后剩下的候选
+llama_token SampleRow(llama_sampler* sampler, const float* logits, int n_vocab,
+                      std::vector<llama_token_data>* candidates, float* probability) {
+  auto& cur = *candidates;
+  cur.resize(n_vocab);
+  for (llama_token id = 0; id < n_vocab; ++id) {
+    cur[id] = {id, logits[id], 0.0f};
+  }
+  llama_token_data_array cur_p = {cur.data(), cur.size(), -1, false};
+  llama_sampler_apply(sampler, &cur_p);
+  const llama_token_data& selected = cur_p.data[cur_p.selected];
+  llama_sampler_accept(sampler, selected.id);
+  float max = selected.logit;
+  for (size_t i = 0; i < cur_p.size; ++i) {
+    max = std::max(max, cur_p.data[i].logit);
+  }
+  double sum = 0;
+  for (size_t i = 0; i < cur_p.size; ++i) {
+    sum += std::exp(cur_p.data[i].logit - max);
+  }
+  *probability = sum > 0 ? float(std::exp(selected.logit - max) / sum) : 0.0f;
+  return selected.id;
+}
+
+// 保存 KV 状态的文件：magic、版本、模型路径、prompt 条目、token、llama 序列状态
+constexpr uint32_t kStateMagic = 0x534c5043;  // "CPLS"
+constexpr uint32_t kStateVersion = 1;
+
+template <typename T>
+void WritePod(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void WriteString(std::ostream& out, const std::string& s) {
+  WritePod(out, uint32_t(s.size()));
+  out.write(s.data(), s.size());
+}
+
+template <typename T>
+bool ReadPod(std::istream& in, T* value) {
+  return bool(in.read(reinterpret_cast<char*>(value), sizeof(T)));
+}
+
+bool ReadString(std::istream& in, std::string* s) {
+  constexpr uint32_t kMaxSize = 1 << 20;
+  uint32_t n = 0;
+  if (!ReadPod(in, &n) || n > kMaxSize) {
+    return false;
+  }
+  s->resize(n);
+  return bool(in.read(s->data(), n));
+}
+
+// 短语边界：标点或换行
+bool IsPhraseBoundary(std::string_view piece) {
+  static const char* const kPunct[] = {"，", "。", "！", "？", "；", "：", "、", "…",
+                                       "“",  "”",  "（", "）", "《", "》"};
+  for (char c : piece) {
+    if (c == '\n' || c == '\r' || c == ',' || c == '.' || c == '!' || c == '?' || c == ';' ||
+        c == ':') {
+      return true;
+    }
+  }
+  for (const char* punct : kPunct) {
+    if (piece.find(punct) != std::string_view::npos) {
+      return true;
+    }
+  }
+  return false;
+}
 }  // namespace
 
 namespace llama {
@@ -82,6 +300,7 @@ struct HistoryEntry {
   llama_pos pos = -1;
   uint32_t seq_id = 0;
   int64_t time_us = 0;
+  bool generated = false;  // 生成的 token（否则为 prompt），覆盖位置 (p0, p1]
 };
 
 struct Reciept {
@@ -91,6 +310,8 @@ struct Reciept {
   llama_pos p2 = -1;
   llama_pos pos = -1;
   llama_token token_id = -1;
+  Status status = Status::kOk;
+  float confidence = 1.0f;
   std::string result;
 };
 
@@ -98,17 +319,48 @@ struct Ticket : public Reciept {
   Ticket(int id, int n_pr) : seq_id(id), n_predict(n_pr) {}
   const int seq_id;
   const int n_predict;
-  llama_sampler* sampler;
+  const llama_sampler* proto = nullptr;  // client 的采样器模板
+  llama_sampler* sampler = nullptr;      // 本 ticket 独占的副本，由 Backend 分配
+  llama_token sampled = -1;
+  float probability = 1.0f;  // sampled 的概率
+  bool stop_at_boundary = false;
+  float min_confidence = 0.0f;
   // common_sampler* smpl;
   StreamCallback callback = nullptr;
   std::function<void(const Reciept&)> on_first_token = nullptr;
   std::function<void(const Reciept&)> on_finish = nullptr;
+  std::function<void(const Reciept&)> on_fail = nullptr;
 
   std::promise<bool> promise;
   std::vector<llama_token> tokens;
+  std::vector<llama_token_data> candidates;  // 采样时的候选数组，跨 token 复用
   int i_batch = -1;
 };
 
+// decode 之后各序列的采样互不依赖，在调用线程和几个常驻线程上并行执行
+class SamplingPool {
+ public:
+  explicit SamplingPool(int n_threads);
+  ~SamplingPool();
+
+  // 执行 fn(0..n-1)，全部完成后返回
+  void run(int n, const std::function<void(int)>& fn);
+
+ private:
+  void work();
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  const std::function<void(int)>* fn_ = nullptr;
+  int n_ = 0;
+  std::atomic<int> next_{0};
+  int active_ = 0;
+  uint64_t generation_ = 0;
+  bool stop_ = false;
+};
+
 class Backend {
  public:
   explicit Backend(const BackendConfig& config);
@@ -130,16 +382,36 @@ class Backend {
   }
 
   llama_model* model() { return model_; }
+  int n_seq_max() const { return config_.n_seq_max; }
+  // 删除序列头部后能否把后面的位置前移（RoPE K-shift）
+  bool can_shift() const { return can_shift_; }
+  // client 销毁前调用：释放由它的采样器模板克隆出来的副本
+  void drop_samplers(const llama_sampler* proto);
+
+  // 序列被 Backend 清空或移位（KV 饱和恢复）时递增；client 据此判断自己记录的位置是否失效
+  uint32_t epoch(int seq_id) const { return seq_epoch_[seq_id].load(); }
+  BackendStats stats() const {
+    return {saturated_.load(), evicted_.load(), shifted_.load(), failed_tickets_.load()};
+  }
 
   int Tokenize(int seq_id, const std::string& prompt, bool is_first,
                std::vector<llama_token>* prompt_tokens, bool apply_chat_template) const;
   std::string ApplyChatTemplate(const std::string& prompt) const;
+  // 同一模型的 client 共用一份词表 mask
+  TokenMask vocab_mask(VocabMask kind);
 
  private:
   bool init(const BackendConfig& config);
   void resize_kv_cache();
   void run();
   void process(int n_tokens, std::list<std::unique_ptr<Ticket>>* ts);
+  // 结束一个无法继续的 ticket：回滚它写入的 KV，结果为 false
+  void fail(Ticket* t, Status status);
+  // KV 已满：先清空最久未用的空闲序列，没有时对本批次最长的序列做 context shift
+  bool recover(const std::list<std::unique_ptr<Ticket>>& decoded);
+  // ticket 结束：归还采样器并通知 client
+  void done(Ticket* t, bool ok);
+  llama_sampler* acquire_sampler(const llama_sampler* proto);
 
   llama_context* ctx_ = nullptr;
   llama_model* model_ = nullptr;
@@ -147,6 +419,7 @@ class Backend {
 
   BackendConfig config_;
   const char* tpl_ = nullptr;
+  bool can_shift_ = false;
 
   std::thread worker_;
   std::list<std::unique_ptr<Ticket>> tickets_;
@@ -155,9 +428,27 @@ class Backend {
   std::thread thread_;
   bool running_;
 
+  // 按提交顺序执行：pop_front 之后的 entry 位置已按前移后的坐标记录
+  struct KvOp {
+    HistoryEntry entry;
+    bool front = false;
+  };
   std::mutex kv_mutex_;
-  std::deque<HistoryEntry> pop_back_;
-  std::deque<HistoryEntry> pop_front_;
+  std::deque<KvOp> kv_ops_;
+
+  // 每个活跃序列一个采样器副本（惩罚项等状态互不干扰），用完 reset 后复用
+  std::mutex sampler_mutex_;
+  std::unordered_map<const llama_sampler*, std::vector<llama_sampler*>> free_samplers_;
+  std::map<VocabMask, TokenMask> vocab_masks_;
+  std::unique_ptr<SamplingPool> sampling_;
+
+  std::unordered_set<int> busy_seqs_;   // 有 ticket 在处理或排队的序列
+  std::vector<int64_t> seq_used_us_;    // 序列最近一次被调度的时间
+  std::vector<std::atomic<uint32_t>> seq_epoch_;
+  std::atomic<uint64_t> saturated_{0};
+  std::atomic<uint64_t> evicted_{0};
+  std::atomic<uint64_t> shifted_{0};
+  std::atomic<uint64_t> failed_tickets_{0};
 
   // llama_batch
   std::vector<llama_token> token_;
@@ -191,6 +482,7 @@ struct ClientImpl {
   void clear();
   void pop_back();
   void pop_front();
+  bool rewind();
 
   int seq_id = 0;
   std::string name;
@@ -206,15 +498,24 @@ struct ClientImpl {
   std::unique_ptr<History> history;
   std::shared_future<bool> future;
   std::atomic_bool stop = false;
+  bool prefilled = true;  // 最近一次 prompt 已写入 KV
+  uint32_t epoch = 0;     // history 中的位置对应的 Backend 序列版本
+  Status status = Status::kOk;
+  float confidence = 0.0f;
 
-  std::function<void(const std::string&)> on_destruction;
+  std::function<void()> on_destruction;
 };
 
 inline ClientImpl::~ClientImpl() {
   cancel();
+  // 归还 seq_id 前清空该序列，后来者从空序列开始
+  HistoryEntry entry;
+  entry.seq_id = seq_id;
+  backend->pop_back(entry);
+  backend->drop_samplers(sampler);
   llama_sampler_free(sampler);
   // common_sampler_free(smpl);
-  on_destruction(model);
+  on_destruction();
 }
 
 inline void ClientImpl::wait() {
@@ -225,6 +526,8 @@ inline void ClientImpl::wait() {
 
 inline void ClientImpl::clear() {
   cancel();
+  prefilled = true;
+  epoch = backend->epoch(seq_id);
   if (history->empty()) {
     return;
   }
@@ -248,12 +551,35 @@ inline void ClientImpl::pop_back() {
 }
 
 inline void ClientImpl::pop_front() {
+  cancel();
   if (history->empty()) {
     return;
   }
-  const auto& first_entry = history->front();
-  backend->pop_front(first_entry);
+  const HistoryEntry first = history->front();
   history->pop_front();
+  backend->pop_front(first);
+  if (!backend->can_shift()) {
+    return;  // 只删除，不移位：后面的位置保持不变
+  }
+  // 与 Backend 同步：之后的 entry 整体前移 (p1 - p0)
+  const llama_pos delta = first.p1 - first.p0;
+  for (auto& entry : *history) {
+    entry.p0 -= delta;
+    entry.p1 -= delta;
+    entry.pos -= delta;
+  }
+  pos -= delta;
+}
+
+inline bool ClientImpl::rewind() {
+  cancel();
+  if (!prefilled || epoch != backend->epoch(seq_id)) {
+    return false;  // prompt 没写进去，或序列已被 Backend 清空 / 移位
+  }
+  if (!history->empty() && history->back().generated) {
+    pop_back();
+  }
+  return true;
 }
 
 inline void ClientImpl::cancel() {
@@ -286,7 +612,9 @@ inline void ClientImpl::commit(const std::string& prompt) {
   int n_predict = config.n_predict;
   auto ticket = std::make_unique<Ticket>(seq_id, n_predict);
   ticket->tokens = std::move(tokens);
-  ticket->sampler = sampler;
+  ticket->proto = sampler;
+  ticket->stop_at_boundary = config.stop_at_boundary;
+  ticket->min_confidence = config.min_confidence;
   // ticket->smpl = smpl;
   ticket->callback = [this](const std::string_view& token) {
     if (stop) {
@@ -294,8 +622,10 @@ inline void ClientImpl::commit(const std::string& prompt) {
     }
     return callback(token);
   };
+  prefilled = false;
   ticket->on_first_token = [this, empty = prompt.empty()](const Reciept& r) {
     pos = r.pos;
+    prefilled = true;
     if (!empty) {
       // std::cerr << "[on_first_token. id: " << seq_id << ", p:[" << r.p0 << "," << r.p1
       //           << "], pos: " << pos << ", history:" << history->size() << ", str: '"
@@ -310,8 +640,17 @@ inline void ClientImpl::commit(const std::string& prompt) {
     //           << ", history:" << history->size() << ", str: '" << backend->detokenize(r.token_id)
     //           << "']" << std::endl;
     history->emplace_back(HistoryEntry(seq_id, r.token_id, r.p1, r.p2, pos));
+    history->back().generated = true;
+    status = Status::kOk;
+    confidence = r.confidence;
     on_finish(r.result);
   };
+  ticket->on_fail = [this](const Reciept& r) {
+    status = r.status;
+    if (status != Status::kCancelled) {
+      on_finish("");  // 尽快通知等待结果的一方，不让它等到超时
+    }
+  };
   ticket->p0 = -1;
   ticket->pos = pos;
   future = ticket->promise.get_future();
@@ -336,12 +675,88 @@ void Client::wait() { client_->wait(); }
 void Client::clear() { client_->clear(); }
 void Client::pop_back() { client_->pop_back(); }
 void Client::pop_front() { client_->pop_front(); }
+bool Client::rewind() { return client_->rewind(); }
+Status Client::status() const { return client_->status; }
+float Client::confidence() const { return client_->confidence; }
+BackendStats Client::backend_stats() const { return client_->backend->stats(); }
+size_t Client::size() const { return client_->history->size(); }
+int Client::n_tokens() const {
+  const auto& history = *client_->history;
+  return history.empty() ? 0 : history.back().p1 - history.front().p0;
+}
+void Client::set_n_predict(int n_predict) { client_->config.n_predict = n_predict; }
 
 }  // namespace llama
 
 // Backend
 namespace llama {
 namespace {
+SamplingPool::SamplingPool(int n_threads) {
+  for (int i = 0; i < n_threads; ++i) {
+    threads_.emplace_back([this] { work(); });
+  }
+}
+
+SamplingPool::~SamplingPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+inline void SamplingPool::run(int n, const std::function<void(int)>& fn) {
+  if (n <= 1 || threads_.empty()) {
+    for (int i = 0; i < n; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fn_ = &fn;
+    n_ = n;
+    next_ = 0;
+    active_ = threads_.size();
+    ++generation_;
+  }
+  cv_.notify_all();
+  for (int i; (i = next_++) < n;) {
+    fn(i);
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return active_ == 0; });
+  fn_ = nullptr;
+}
+
+inline void SamplingPool::work() {
+  uint64_t seen = 0;
+  while (true) {
+    const std::function<void(int)>* fn;
+    int n;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) {
+        return;
+      }
+      seen = generation_;
+      fn = fn_;
+      n = n_;
+    }
+    for (int i; (i = next_++) < n;) {
+      (*fn)(i);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--active_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+}
+
 Backend::Backend(const BackendConfig& config) { init(config); }
 Backend::~Backend() {
   {
@@ -349,10 +764,15 @@ Backend::~Backend() {
     running_ = false;
   }
   cv_.notify_one();
+  worker_.join();
+  sampling_.reset();
+  for (auto& entry : free_samplers_) {
+    for (auto* sampler : entry.second) {
+      llama_sampler_free(sampler);
+    }
+  }
   llama_free(ctx_);
   llama_model_free(model_);
-  llama_backend_free();
-  worker_.join();
 }
 
 inline bool Backend::init(const BackendConfig& cfg) {
@@ -370,14 +790,27 @@ inline bool Backend::init(const BackendConfig& cfg) {
   ctx_params.n_ctx = cfg.n_ctx;
   ctx_params.n_batch = cfg.n_batch;
   ctx_params.no_perf = cfg.no_perf;
-  ctx_params.n_threads = std::thread::hardware_concurrency();
+  ctx_params.n_threads =
+      cfg.n_threads > 0 ? cfg.n_threads : int(std::thread::hardware_concurrency());
+  ctx_params.n_seq_max = std::max(1, cfg.n_seq_max);
+  // 所有序列共用一个 KV 池：空闲客户端的上下文不单独占一份 n_ctx
+  ctx_params.kv_unified = true;
 
   ctx_ = llama_init_from_model(model_, ctx_params);
   if (!ctx_) {
     throw std::runtime_error("上下文初始化失败");
     return false;
   }
+  config_ = cfg;
   config_.n_ctx = llama_n_ctx(ctx_);
+  config_.n_seq_max = llama_n_seq_max(ctx_);
+  can_shift_ = llama_memory_can_shift(llama_get_memory(ctx_));
+  seq_used_us_.assign(config_.n_seq_max, 0);
+  seq_epoch_ = std::vector<std::atomic<uint32_t>>(config_.n_seq_max);
+  int n_sampling = std::min<int>(config_.n_seq_max, std::thread::hardware_concurrency());
+  sampling_ = std::make_unique<SamplingPool>(std::max(0, n_sampling - 1));
+  LOG(INFO) << "[LLM] backend: " << cfg.model_path << ", n_ctx: " << config_.n_ctx
+            << ", n_seq_max: " << config_.n_seq_max << ", can_shift: " << can_shift_;
 
   tpl_ = llama_model_chat_template(model_, nullptr);
 
@@ -434,6 +867,18 @@ inline std::string Backend::ApplyChatTemplate(const std::string& prompt) const {
   return result;
 }
 
+inline TokenMask Backend::vocab_mask(VocabMask kind) {
+  if (kind == VocabMask::kNone) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(sampler_mutex_);
+  auto& mask = vocab_masks_[kind];
+  if (!mask) {
+    mask = BuildVocabMask(vocab_, kind);
+  }
+  return mask;
+}
+
 inline void Backend::commit(std::unique_ptr<Ticket>&& ticket) {
   {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -444,55 +889,40 @@ inline void Backend::commit(std::unique_ptr<Ticket>&& ticket) {
 
 inline void Backend::pop_back(const HistoryEntry& entry) {
   std::lock_guard<std::mutex> lock(kv_mutex_);
-  pop_back_.push_back(entry);
+  kv_ops_.push_back({entry, false});
 }
 
 inline void Backend::pop_front(const HistoryEntry& entry) {
   std::lock_guard<std::mutex> lock(kv_mutex_);
-  pop_front_.push_back(entry);
+  kv_ops_.push_back({entry, true});
 }
 
 inline void Backend::resize_kv_cache() {
-  std::deque<HistoryEntry> back;
-  std::deque<HistoryEntry> front;
+  std::deque<KvOp> ops;
   {
     std::lock_guard<std::mutex> lock(kv_mutex_);
-    back.swap(pop_back_);
-    front.swap(pop_front_);
-  }
-  std::unordered_map<uint32_t, int> pop_back_map;
-  for (const auto& entry : back) {
-    auto it = pop_back_map.find(entry.seq_id);
-    if (it == pop_back_map.end()) {
-      pop_back_map.insert({entry.seq_id, entry.p0});
-    } else {
-      it->second = std::min(entry.p0, it->second);
-    }
+    ops.swap(kv_ops_);
   }
-  for (const auto& entry : pop_back_map) {
-    int seq_id = entry.first;
-    int p0 = entry.second;
-    // std::cerr << "[pop_back: [" << p0 << ", " << "-1] ]";
-    llama_memory_seq_rm(llama_get_memory(ctx_), seq_id, p0, -1);
-  }
-  std::unordered_map<uint32_t, int> pop_front_map;
-  for (const auto& entry : front) {
-    auto it = pop_front_map.find(entry.seq_id);
-    if (it == pop_front_map.end()) {
-      pop_front_map.emplace(entry.seq_id, entry.p1);
-    } else {
-      it->second = std::max(it->second, entry.p1);
+  auto* mem = llama_get_memory(ctx_);
+  for (const auto& op : ops) {
+    // entry 覆盖 (p0, p1]，p0 本身属于前一个 entry
+    const auto& e = op.entry;
+    if (!op.front) {
+      // std::cerr << "[pop_back: [" << e.p0 + 1 << ", " << "-1] ]";
+      llama_memory_seq_rm(mem, e.seq_id, e.p0 + 1, -1);
+      continue;
+    }
+    llama_memory_seq_rm(mem, e.seq_id, e.p0 + 1, e.p1 + 1);
+    if (can_shift_) {
+      // 滑动窗口：后面的 token 前移，序列保持紧凑，无需重新 prefill
+      llama_memory_seq_add(mem, e.seq_id, e.p1 + 1, -1, -(e.p1 - e.p0));
     }
-  }
-  for (const auto& entry : pop_front_map) {
-    int seq_id = entry.first;
-    int p1 = entry.second;
-    llama_memory_seq_rm(llama_get_memory(ctx_), seq_id, -1, p1 - 1);
   }
 }
 
 inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* ts) {
   int n_batch = config_.n_batch;
+  Status status = Status::kNoKvSpace;
   auto& tickets = *ts;
   char buf[128];
   std::list<std::unique_ptr<Ticket>> decoded;
@@ -511,8 +941,20 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
     const int ret = llama_decode(ctx_, batch);
 
     if (ret != 0) {
-      if (n_batch == 1 || ret < 0) {
+      if (ret == 1) {
+        ++saturated_;
+        // 腾出空间后按原大小重试
+        if (recover(decoded)) {
+          i -= n_batch;
+          continue;
+        }
+      }
+      if (n_batch == 1 || ret != 1) {
         // if you get here, it means the KV cache is full - try increasing it via the context size
+        status = ret == 1 ? Status::kNoKvSpace : Status::kDecodeError;
+        LOG(WARNING) << "[LLM] llama_decode failed: " << ret << ", saturated: " << saturated_
+                     << ", evicted: " << evicted_ << ", shifted: " << shifted_
+                     << ", failed tickets: " << failed_tickets_ + decoded.size();
         break;
       }
       // retry with half the batch size to try to find a free slot in the KV cache
@@ -521,6 +963,29 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
       continue;
     }
 
+    std::vector<Ticket*> ready;
+    for (auto& t : decoded) {
+      int ith = t->i_batch - i;
+      if (ith >= 0 && ith < i_tokens) {
+        ready.push_back(t.get());
+      }
+    }
+    // llama_get_logits_ith 首次访问时会重排输出缓冲，不能在 worker 中并发调用：
+    // 在本线程取一次整块 logits，worker 只读各自的那一行
+    const int n_vocab = llama_vocab_n_tokens(vocab_);
+    const float* logits = llama_get_logits(ctx_);
+    std::vector<int> rows(i_tokens);
+    for (int j = 0, row = 0; j < i_tokens; ++j) {
+      rows[j] = row;
+      row += logits_[i + j] != 0;
+    }
+    sampling_->run(ready.size(), [&](int k) {
+      Ticket* t = ready[k];
+      const float* row = logits + size_t(rows[t->i_batch - i]) * n_vocab;
+      t->sampled = SampleRow(t->sampler, row, n_vocab, &t->candidates, &t->probability);
+    });
+
+    // 回调、KV 修改仍在本线程顺序执行
     auto it = decoded.begin();
     while (it != decoded.end()) {
       auto& t = *it;
@@ -530,7 +995,7 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
         continue;
       }
       ++t->n_decoded;
-      const llama_token id = llama_sampler_sample(t->sampler, ctx_, ith);
+      const llama_token id = t->sampled;
 
       // const llama_token id = common_sampler_sample(t->smpl, ctx_, ith);
       // common_sampler_accept(t->smpl, id, true);
@@ -541,20 +1006,34 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
       }
       t->token_id = id;
       if (llama_vocab_is_eog(vocab_, id)) {
+        t->p2 = pos_max(t->seq_id);
         t->on_finish(*t);
-        t->promise.set_value(true);
+        done(t.get(), true);
         auto current = it++;
         decoded.erase(current);
         continue;
       }
       int n = llama_token_to_piece(vocab_, id, buf, sizeof(buf), 0, true);
+      // 提前结束：低置信度的尾巴、短语边界都不计入结果
+      bool low = t->confidence * t->probability < t->min_confidence;
+      bool boundary = t->stop_at_boundary && n > 0 && IsPhraseBoundary(std::string_view(buf, n));
+      if (low || boundary) {
+        t->p2 = pos_max(t->seq_id);
+        t->on_finish(*t);
+        done(t.get(), true);
+        auto current = it++;
+        decoded.erase(current);
+        continue;
+      }
+      t->confidence *= t->probability;
       if (n > 0) {
         t->result.append(buf, n);
         bool ret = t->callback(std::string_view(buf, n));
         if (!ret) {
-          llama_memory_seq_rm(llama_get_memory(ctx_), t->seq_id, t->p1, -1);
+          llama_memory_seq_rm(llama_get_memory(ctx_), t->seq_id, t->p1 + 1, -1);
           logits_[t->i_batch] = 0;  // stop sampling
-          t->promise.set_value(false);
+          t->status = Status::kCancelled;
+          done(t.get(), false);
           auto current = it++;
           decoded.erase(current);
           continue;
@@ -564,7 +1043,7 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
           // logits_[t->i_batch] = 0;  // stop sampling
           t->p2 = pos_max(t->seq_id);
           t->on_finish(*t);
-          t->promise.set_value(true);
+          done(t.get(), true);
           auto current = it++;
           decoded.erase(current);
           continue;
@@ -575,6 +1054,108 @@ inline void Backend::process(int n_tokens, std::list<std::unique_ptr<Ticket>>* t
       tickets.splice(tickets.end(), decoded, current);
     }
   }
+  // KV 已满，剩下的 ticket 无法继续
+  for (auto& t : decoded) {
+    fail(t.get(), status);
+  }
+}
+
+inline void Backend::fail(Ticket* t, Status status) {
+  if (t->i_batch >= 0) {
+    llama_pos p = t->n_decoded > 0 ? t->p1 + 1 : t->p0 + 1;
+    llama_memory_seq_rm(llama_get_memory(ctx_), t->seq_id, std::max(0, p), -1);
+  }
+  ++failed_tickets_;
+  t->status = status;
+  done(t, false);
+}
+
+inline bool Backend::recover(const std::list<std::unique_ptr<Ticket>>& decoded) {
+  auto* mem = llama_get_memory(ctx_);
+  int lru = -1;
+  for (int seq = 0; seq < int(seq_used_us_.size()); ++seq) {
+    if (busy_seqs_.count(seq) || llama_memory_seq_pos_max(mem, seq) < 0) {
+      continue;
+    }
+    if (lru < 0 || seq_used_us_[seq] < seq_used_us_[lru]) {
+      lru = seq;
+    }
+  }
+  if (lru >= 0) {
+    llama_memory_seq_rm(mem, lru, -1, -1);
+    ++seq_epoch_[lru];
+    ++evicted_;
+    DLOG(INFO) << "[LLM] KV full, evicted idle sequence: " << lru;
+    return true;
+  }
+  if (!can_shift_) {
+    return false;
+  }
+  // context shift：丢弃最长序列前一半，后面的位置前移
+  Ticket* longest = nullptr;
+  llama_pos longest_pos = 0;
+  for (const auto& t : decoded) {
+    llama_pos p = llama_memory_seq_pos_max(mem, t->seq_id);
+    if (p > longest_pos) {
+      longest = t.get();
+      longest_pos = p;
+    }
+  }
+  const llama_pos n_discard = (longest_pos + 1) / 2;
+  if (!longest || n_discard <= 0) {
+    return false;
+  }
+  const int seq = longest->seq_id;
+  llama_memory_seq_rm(mem, seq, 0, n_discard);
+  llama_memory_seq_add(mem, seq, n_discard, -1, -n_discard);
+  for (const auto& t : decoded) {
+    if (t->seq_id == seq) {
+      t->p0 = std::max(-1, t->p0 - n_discard);
+      t->p1 = std::max(-1, t->p1 - n_discard);
+    }
+  }
+  ++seq_epoch_[seq];
+  ++shifted_;
+  DLOG(INFO) << "[LLM] KV full, shifted sequence " << seq << " by " << n_discard;
+  return true;
+}
+
+inline void Backend::done(Ticket* t, bool ok) {
+  if (t->sampler) {
+    llama_sampler_reset(t->sampler);
+    std::lock_guard<std::mutex> lock(sampler_mutex_);
+    free_samplers_[t->proto].push_back(t->sampler);
+    t->sampler = nullptr;
+  }
+  if (!ok && t->on_fail) {
+    t->on_fail(*t);
+  }
+  t->promise.set_value(ok);
+}
+
+inline llama_sampler* Backend::acquire_sampler(const llama_sampler* proto) {
+  {
+    std::lock_guard<std::mutex> lock(sampler_mutex_);
+    auto it = free_samplers_.find(proto);
+    if (it != free_samplers_.end() && !it->second.empty()) {
+      llama_sampler* sampler = it->second.back();
+      it->second.pop_back();
+      return sampler;
+    }
+  }
+  return llama_sampler_clone(proto);
+}
+
+inline void Backend::drop_samplers(const llama_sampler* proto) {
+  std::lock_guard<std::mutex> lock(sampler_mutex_);
+  auto it = free_samplers_.find(proto);
+  if (it == free_samplers_.end()) {
+    return;
+  }
+  for (auto* sampler : it->second) {
+    llama_sampler_free(sampler);
+  }
+  free_samplers_.erase(it);
 }
 
 inline void Backend::run() {
@@ -594,13 +1175,28 @@ inline void Backend::run() {
 
     resize_kv_cache();
 
+    // 本轮放不下的 ticket 留到下一轮
+    const int capacity = token_.size();
     int n_tokens = 0;
-    for (auto& t : tickets) {
+    std::list<std::unique_ptr<Ticket>> batch;
+    for (auto it = tickets.begin(); it != tickets.end();) {
+      auto& t = *it;
       const auto& tokens = t->tokens;
-      if (t->p0 < 0) {
+      int n = tokens.size();
+      if (n == 0 || n > capacity) {
+        fail(t.get(), Status::kNoKvSpace);
+        it = tickets.erase(it);
+        continue;
+      }
+      if (n_tokens + n > capacity) {
+        ++it;
+        continue;
+      }
+      if (t->i_batch < 0) {
         t->p0 = llama_memory_seq_pos_max(llama_get_memory(ctx_), t->seq_id);
+        t->sampler = acquire_sampler(t->proto);
+        seq_used_us_[t->seq_id] = llama_time_us();
       }
-      int n = tokens.size();
       for (int i = 0; i < n; ++i) {
         token_[n_tokens + i] = tokens[i];
         pos_[n_tokens + i] = t->pos + i;
@@ -612,9 +1208,18 @@ inline void Backend::run() {
       t->i_batch = n_tokens - 1;
       t->token_id = tokens.back();
       t->pos = pos_[n_tokens - 1];
+      auto current = it++;
+      batch.splice(batch.end(), tickets, current);
     }
 
-    process(n_tokens, &tickets);
+    busy_seqs_.clear();
+    for (const auto* list : {&batch, &tickets}) {
+      for (const auto& t : *list) {
+        busy_seqs_.insert(t->seq_id);
+      }
+    }
+    process(n_tokens, &batch);
+    tickets.splice(tickets.begin(), batch);
   }
 }
 
@@ -626,45 +1231,55 @@ namespace llama {
 
 class LLMManager::Impl {
  public:
-  std::unique_ptr<Client> CreateClient(const std::string& model, const std::string& name,
+  std::unique_ptr<Client> CreateClient(const BackendConfig& backend, const std::string& name,
                                        const ClientConfig&, StreamCallback callback,
                                        OnFinishCallback on_finish);
+  std::shared_ptr<void> Hold(const std::string& model);
 
  private:
-  void RemoveClient(const std::string&);
+  void RemoveClient(const std::string& model, const std::string& name, uint32_t seq_id);
+  void Release(const std::string& model);
 
   struct Server {
     std::shared_ptr<Backend> backend;
     std::unordered_set<std::string> clients;
     int n_clients = 0;
-    uint32_t next_seq_id = 0;
+    int n_holds = 0;
+    std::vector<uint32_t> free_seq_ids;
   };
   std::mutex server_mutex_;
   std::unordered_map<std::string, Server> servers_;
 };
 
-inline std::unique_ptr<Client> LLMManager::Impl::CreateClient(const std::string& model,
-                                                              const std::string& name,
-                                                              const ClientConfig& config,
-                                                              StreamCallback callback,
-                                                              OnFinishCallback on_finish) {
+inline std::unique_ptr<Client> LLMManager::Impl::CreateClient(
+    const BackendConfig& backend_config, const std::string& name, const ClientConfig& config,
+    StreamCallback callback, OnFinishCallback on_finish) {
+  const std::string& model = backend_config.model_path;
   std::shared_ptr<Backend> backend;
   uint32_t seq_id;
   {
     std::lock_guard<std::mutex> lk(server_mutex_);
     auto it = servers_.find(model);
     if (it == servers_.end()) {
-      BackendConfig config;
-      config.model_path = model;
-      auto backend = std::make_shared<Backend>(config);
-      it = servers_.insert({model, Server{std::move(backend)}}).first;
+      Server server;
+      server.backend = std::make_shared<Backend>(backend_config);
+      for (int i = server.backend->n_seq_max() - 1; i >= 0; --i) {
+        server.free_seq_ids.push_back(i);
+      }
+      it = servers_.emplace(model, std::move(server)).first;
     }
     auto& server = it->second;
     if (server.clients.find(name) != server.clients.end()) {
       return nullptr;
     }
+    if (server.free_seq_ids.empty()) {
+      LOG(WARNING) << "[LLM] no free sequence for client: " << name;
+      return nullptr;
+    }
     ++server.n_clients;
-    seq_id = ++server.next_seq_id;
+    server.clients.insert(name);
+    seq_id = server.free_seq_ids.back();
+    server.free_seq_ids.pop_back();
     backend = server.backend;
   }
   auto impl = std::make_shared<ClientImpl>();
@@ -675,34 +1290,63 @@ inline std::unique_ptr<Client> LLMManager::Impl::CreateClient(const std::string&
   impl->callback = callback;
   impl->callback = callback ? callback : [](const std::string_view&) -> bool { return true; };
   impl->on_finish = on_finish ? on_finish : [](const std::string&) {};
-  impl->sampler = create_sampler(config);
+  impl->sampler = create_sampler(config, backend->vocab_mask(config.vocab_mask));
   // common_params_sampling param;
   // impl->smpl = common_sampler_init(backend->model(), param);
   impl->history = std::make_unique<History>();
   impl->backend = backend;
-  impl->on_destruction = [this](const std::string& model) { this->RemoveClient(model); };
+  impl->on_destruction = [this, model, name, seq_id]() { RemoveClient(model, name, seq_id); };
   return std::unique_ptr<Client>(new Client(impl));
 }
 
-inline void LLMManager::Impl::RemoveClient(const std::string& model) {
+inline void LLMManager::Impl::RemoveClient(const std::string& model, const std::string& name,
+                                           uint32_t seq_id) {
+  std::lock_guard<std::mutex> lk(server_mutex_);
+  auto it = servers_.find(model);
+  if (it == servers_.end()) {
+    return;
+  }
+  auto& server = it->second;
+  server.clients.erase(name);
+  server.free_seq_ids.push_back(seq_id);
+  if (--server.n_clients == 0 && server.n_holds == 0) {
+    servers_.erase(it);
+  }
+}
+
+inline std::shared_ptr<void> LLMManager::Impl::Hold(const std::string& model) {
+  std::lock_guard<std::mutex> lk(server_mutex_);
+  auto it = servers_.find(model);
+  if (it == servers_.end()) {
+    return nullptr;
+  }
+  ++it->second.n_holds;
+  return std::shared_ptr<void>(static_cast<void*>(this),
+                               [this, model](void*) { Release(model); });
+}
+
+inline void LLMManager::Impl::Release(const std::string& model) {
   std::lock_guard<std::mutex> lk(server_mutex_);
   auto it = servers_.find(model);
   if (it == servers_.end()) {
     return;
   }
   auto& server = it->second;
-  if (--server.n_clients == 0) {
+  if (--server.n_holds == 0 && server.n_clients == 0) {
     servers_.erase(it);
   }
 }
 
-std::unique_ptr<Client> LLMManager::CreateClient(const std::string& model, const std::string& name,
+std::unique_ptr<Client> LLMManager::CreateClient(const BackendConfig& backend,
+                                                 const std::string& name,
                                                  const ClientConfig& config,
                                                  StreamCallback callback,
                                                  OnFinishCallback on_finish) {
-  return impl_->CreateClient(model, name, config, callback, on_finish);
+  return impl_->CreateClient(backend, name, config, callback, on_finish);
 }
 
+std::shared_ptr<void> LLMManager::Hold(const std::string& model) { return impl_->Hold(model); }
+
 LLMManager::LLMManager() {
   llama_log_set([](ggml_log_level /*level*/, const char* /*text*/, void* /*user_data*/) {},
                 nullptr);
@@ -716,61 +1360,262 @@ LLMManager::~LLMManager() { llama_backend_free(); }
 
 namespace llama {
 
+// 按 History 条目缓存分词结果。
+// 每条记录接在前一个 token 之后分词，只在接缝处重新切分；
+// 前一个 token 不变时直接复用，新提交只需对新条目分词。
+class PromptTokenizer {
+ public:
+  explicit PromptTokenizer(const llama_vocab* vocab) : vocab_(vocab) {
+    bos_ = tokenize("", true);
+  }
+
+  // 单独切分一段文本（不加 BOS，不处理与 prompt 的接缝）
+  std::vector<llama_token> tokenize(const std::string& text) const { return tokenize(text, false); }
+
+  const std::vector<llama_token>& tokenize(const std::vector<std::string>& texts) {
+    align(texts);
+    for (size_t i = entries_.size(); i < texts.size(); ++i) {
+      entries_.push_back(Entry{texts[i]});
+    }
+    prompt_ = bos_;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      auto& entry = entries_[i];
+      // 窗口第一条单独分词，其余接在前一个 token 之后
+      llama_token prev = (i == 0 || prompt_.empty()) ? kNoToken : prompt_.back();
+      if (!entry.valid || entry.prev != prev) {
+        fit(&entry, prev);
+      }
+      if (entry.replaces_prev) {
+        prompt_.pop_back();
+      }
+      prompt_.insert(prompt_.end(), entry.tokens.begin(), entry.tokens.end());
+    }
+    return prompt_;
+  }
+
+ private:
+  static constexpr llama_token kNoToken = -1;
+
+  struct Entry {
+    std::string text;
+    llama_token prev = kNoToken;  // tokens 是接在这个 token 之后切分的
+    std::vector<llama_token> tokens;
+    bool replaces_prev = false;  // 接缝处合并：tokens 取代 prev
+    bool valid = false;
+  };
+
+  std::vector<llama_token> tokenize(const std::string& text, bool add_special) const {
+    int n = -llama_tokenize(vocab_, text.data(), text.size(), nullptr, 0, add_special, true);
+    std::vector<llama_token> tokens(std::max(0, n));
+    if (n > 0 && llama_tokenize(vocab_, text.data(), text.size(), tokens.data(), n, add_special,
+                                true) < 0) {
+      tokens.clear();
+    }
+    return tokens;
+  }
+
+  void fit(Entry* entry, llama_token prev) const {
+    entry->prev = prev;
+    entry->valid = true;
+    entry->replaces_prev = false;
+    char buf[128];
+    int n = prev == kNoToken ? 0 : llama_token_to_piece(vocab_, prev, buf, sizeof(buf), 0, true);
+    if (n <= 0) {
+      entry->tokens = tokenize(entry->text, false);
+      return;
+    }
+    // 前一个 token 的文本 + 本条文本，重新切分接缝
+    entry->tokens = tokenize(std::string(buf, n) + entry->text, false);
+    if (!entry->tokens.empty() && entry->tokens.front() == prev) {
+      entry->tokens.erase(entry->tokens.begin());
+    } else {
+      entry->replaces_prev = true;
+    }
+  }
+
+  // 丢弃已滑出窗口的条目；缓存与新 prompt 对不上时整体重建
+  void align(const std::vector<std::string>& texts) {
+    for (size_t skip = 0; skip < entries_.size(); ++skip) {
+      size_t n = entries_.size() - skip;
+      bool match = n <= texts.size();
+      for (size_t j = 0; match && j < n; ++j) {
+        match = entries_[skip + j].text == texts[j];
+      }
+      if (match) {
+        entries_.erase(entries_.begin(), entries_.begin() + skip);
+        return;
+      }
+    }
+    entries_.clear();
+  }
+
+  const llama_vocab* vocab_;
+  std::vector<llama_token> bos_;
+  std::deque<Entry> entries_;
+  std::vector<llama_token> prompt_;
+};
+
 ClientSimple::ClientSimple(ClientConfig config, const std::string& model,
                            OnFinishCallback on_finish)
-    : config_(config), model_path_(model), on_finish_(on_finish) {
+    : config_(config), model_path_(model), on_finish_(on_finish), n_predict_(config.n_predict) {
   llama_log_set([](ggml_log_level /*level*/, const char* /*text*/, void* /*user_data*/) {},
                 nullptr);
   llama_backend_init();
 
-  llama_model_params model_params = llama_model_default_params();
-  model_params.n_gpu_layers = 99;
-  model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
-  if (!model_) {
+  if (!Load()) {
     throw std::runtime_error("模型加载失败");
   }
-
-  vocab_ = llama_model_get_vocab(model_);
-
-  auto ctx_params = llama_context_default_params();
-  ctx_params.n_ctx = 0;
-  ctx_params.n_batch = 512;
-  ctx_params.no_perf = false;
-  ctx_params.n_threads = std::thread::hardware_concurrency();
-
-  ctx_ = llama_init_from_model(model_, ctx_params);
-  if (!ctx_) {
-    throw std::runtime_error("上下文初始化失败");
-  }
-  n_ctx_ = llama_n_ctx(ctx_);
-  sampler_ = create_sampler(config);
+  restored_entries_ = kv_entries_;
+  sampler_ = create_sampler(config, BuildVocabMask(vocab_, config.vocab_mask));
 
   worker_ = std::make_shared<std::thread>([this]() {
+    const auto idle_timeout = std::chrono::seconds(config_.idle_unload_seconds);
     while (true) {
+      std::vector<std::string> prompt;
+      std::vector<std::string> candidates;
+      OnScoreCallback on_score;
+      std::shared_ptr<std::promise<void>> task;
+      std::chrono::milliseconds delay{0};
       {
         std::unique_lock<std::mutex> lock(mutex_);
-        cond_.wait(lock, [this] { return has_new_task_ || shutdown_; });
+        auto ready = [this] { return has_new_task_ || shutdown_; };
+        if (config_.idle_unload_seconds > 0 && loaded_) {
+          if (!cond_.wait_for(lock, idle_timeout, ready)) {
+            lock.unlock();
+            Unload();  // 空闲超时：释放 context（以及可选的模型权重）
+            continue;
+          }
+        } else {
+          cond_.wait(lock, ready);
+        }
+        if (shutdown_) {
+          break;
+        }
+        prompt = pending_prompt_;
+        candidates = pending_candidates_;
+        on_score = pending_on_score_;
+        delay = pending_delay_;
+        task = running_task_;
+        has_new_task_ = false;
+        // 已被新的输入取代：不再 decode
+        if (stop_) {
+          ++n_superseded_;
+          task->set_value();
+          continue;
+        }
+        // 去抖：安静期内又有输入（或被 clear），只处理最新的那一个
+        if (delay.count() > 0 &&
+            cond_.wait_for(lock, delay, [this] { return stop_ || shutdown_; })) {
+          ++n_debounced_;
+          task->set_value();
+          continue;
+        }
       }
-      if (shutdown_) {
-        break;
+      if (!loaded_) {
+        if (Load()) {
+          llama_sampler_reset(sampler_);
+        }
+        // 加载期间有新的输入：只处理最新的那一个
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (has_new_task_) {
+          task->set_value();
+          prompt = pending_prompt_;
+          candidates = pending_candidates_;
+          on_score = pending_on_score_;
+          task = running_task_;
+          has_new_task_ = false;
+        }
       }
-      auto prompt = pending_prompt_;
-      has_new_task_ = false;
-      run(prompt);
-      running_task_->set_value();
+      if (loaded_ && on_score) {
+        run_score(prompt, candidates, on_score);
+      } else if (loaded_) {
+        run(prompt);
+      }
+      task->set_value();
     }
   });
 }
 
 ClientSimple::~ClientSimple() {
   stop_ = true;
-  shutdown_ = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
   cond_.notify_one();
+  worker_->join();
+  if (loaded_) {
+    SaveState();
+  }
   llama_sampler_free(sampler_);
   llama_free(ctx_);
   llama_model_free(model_);
   llama_backend_free();
-  worker_->join();
+}
+
+bool ClientSimple::Load() {
+  const int64_t t_start_us = llama_time_us();
+  if (!model_) {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = 99;
+    model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
+    if (!model_) {
+      LOG(ERROR) << "[LLM] failed to load model: " << model_path_;
+      return false;
+    }
+    vocab_ = llama_model_get_vocab(model_);
+    tokenizer_ = std::make_unique<PromptTokenizer>(vocab_);
+  }
+  const int64_t t_model_us = llama_time_us();
+
+  auto ctx_params = llama_context_default_params();
+  ctx_params.n_ctx = 0;
+  ctx_params.n_batch = 512;
+  ctx_params.no_perf = false;
+  ctx_params.n_threads = std::thread::hardware_concurrency();
+  if (config_.n_rescore > 0) {
+    // 打分用的序列与 prompt 共享 KV 单元
+    ctx_params.n_seq_max = 1 + config_.n_rescore;
+    ctx_params.kv_unified = true;
+  }
+
+  ctx_ = llama_init_from_model(model_, ctx_params);
+  if (!ctx_) {
+    LOG(ERROR) << "[LLM] failed to create context for: " << model_path_;
+    return false;
+  }
+  n_ctx_ = llama_n_ctx(ctx_);
+  applied_threads_ = ctx_params.n_threads;
+  loaded_ = true;
+  RestoreState();
+
+  const int64_t t_end_us = llama_time_us();
+  LOG(INFO) << "[LLM] loaded in " << (t_end_us - t_start_us) / 1000
+            << " ms (model: " << (t_model_us - t_start_us) / 1000
+            << " ms, context: " << (t_end_us - t_model_us) / 1000 << " ms), n_ctx: " << n_ctx_;
+  return true;
+}
+
+void ClientSimple::Unload() {
+  if (!loaded_) {
+    return;
+  }
+  const int64_t t_start_us = llama_time_us();
+  SaveState();
+  loaded_ = false;
+  llama_free(ctx_);
+  ctx_ = nullptr;
+  kv_tokens_.clear();
+  kv_entries_.clear();
+  if (config_.unload_model) {
+    llama_model_free(model_);
+    model_ = nullptr;
+    vocab_ = nullptr;
+    tokenizer_.reset();
+  }
+  LOG(INFO) << "[LLM] idle for " << config_.idle_unload_seconds << " s, unloaded "
+            << (config_.unload_model ? "model and context" : "context") << " in "
+            << (llama_time_us() - t_start_us) / 1000 << " ms";
 }
 
 void ClientSimple::wait() {
@@ -780,61 +1625,368 @@ void ClientSimple::wait() {
 }
 
 void ClientSimple::commit(const std::string& prompt) {
-  stop_ = true;
-  wait();
+  commit(std::vector<std::string>{prompt});
+}
+
+void ClientSimple::commit(std::vector<std::string> entries, int delay_ms) {
+  submit(std::move(entries), {}, nullptr, delay_ms);
+}
+
+void ClientSimple::score(std::vector<std::string> entries, std::vector<std::string> candidates,
+                         OnScoreCallback on_score) {
+  submit(std::move(entries), std::move(candidates), std::move(on_score), 0);
+}
+
+void ClientSimple::interrupt() {
+  {
+    // 加锁设置：worker 可能正在安静期内等待
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+}
+
+void ClientSimple::submit(std::vector<std::string> entries, std::vector<std::string> candidates,
+                          OnScoreCallback on_score, int delay_ms) {
+  ++n_submitted_;
+  interrupt();
+  if (loaded_) {
+    wait();
+  }
+  // 未加载时不等待：重新加载在后台进行，期间只保留最新的 prompt
+  std::lock_guard<std::mutex> lock(mutex_);
   stop_ = false;
-  pending_prompt_ = prompt;
+  pending_prompt_ = std::move(entries);
+  pending_candidates_ = std::move(candidates);
+  pending_on_score_ = std::move(on_score);
+  pending_delay_ = std::chrono::milliseconds(std::max(0, delay_ms));
   has_new_task_ = true;
   running_task_ = std::make_shared<std::promise<void>>();
   running_future_ = running_task_->get_future().share();
   cond_.notify_one();
 }
 
-bool ClientSimple::run(const std::string& prompt) {
-  int n_prompt = 0;
-  llama_token new_token_id;
-  llama_batch batch;
-  std::vector<llama_token> prompt_tokens;
-
-  const bool is_first = true;
-  auto& p = prompt;
-  n_prompt = -llama_tokenize(vocab_, p.data(), p.size(), nullptr, 0, is_first, true);
-  prompt_tokens.resize(n_prompt);
-  if (llama_tokenize(vocab_, p.data(), p.size(), prompt_tokens.data(), n_prompt, is_first, true) <
-      0) {
+ClientSimple::Stats ClientSimple::stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+ClientSimple::Counters ClientSimple::counters() const {
+  return {n_submitted_.load(),  n_debounced_.load(),     n_superseded_.load(),
+          n_cancelled_.load(), n_wasted_tokens_.load(), n_completed_.load()};
+}
+
+bool ClientSimple::prefill(const std::vector<std::string>& entries, int* n_prompt) {
+  int n_threads = n_threads_;
+  if (n_threads > 0 && n_threads != applied_threads_) {
+    llama_set_n_threads(ctx_, n_threads, n_threads);
+    applied_threads_ = n_threads;
+  }
+
+  const auto& prompt_tokens = tokenizer_->tokenize(entries);
+  if (prompt_tokens.empty()) {
+    return false;
+  }
+  // 与 KV 中已有 token 的公共前缀无需重新 decode（至少留一个 token 以取得 logits）
+  size_t n_common = 0;
+  while (n_common < kv_tokens_.size() && n_common < prompt_tokens.size() &&
+         kv_tokens_[n_common] == prompt_tokens[n_common]) {
+    ++n_common;
+  }
+  n_common = std::min(n_common, prompt_tokens.size() - 1);
+  llama_memory_seq_rm(llama_get_memory(ctx_), 0, n_common, -1);
+  kv_tokens_.assign(prompt_tokens.begin(), prompt_tokens.end());
+  kv_entries_ = entries;
+  *n_prompt = prompt_tokens.size() - n_common;
+  if (llama_decode(ctx_, llama_batch_get_one(kv_tokens_.data() + n_common, *n_prompt)) != 0) {
+    llama_memory_seq_rm(llama_get_memory(ctx_), 0, -1, -1);
+    kv_tokens_.clear();
+    kv_entries_.clear();
     return false;
   }
-  batch = llama_batch_get_one(prompt_tokens.data(), prompt_tokens.size());
+  return true;
+}
 
-  llama_memory_seq_rm(llama_get_memory(ctx_), 0, -1, -1);
-  int n_pos = 0;
-  char buf[128];
-  std::string response;
-  while (n_pos < config_.n_predict) {
-    if (llama_decode(ctx_, batch) != 0) {
+bool ClientSimple::SaveState() const {
+  if (config_.state_file.empty() || !ctx_ || kv_tokens_.empty()) {
+    return false;
+  }
+  const int64_t t_start_us = llama_time_us();
+  std::vector<uint8_t> state(llama_state_seq_get_size(ctx_, 0));
+  if (state.empty() || llama_state_seq_get_data(ctx_, state.data(), state.size(), 0) == 0) {
+    LOG(WARNING) << "[LLM] failed to get sequence state";
+    return false;
+  }
+  // 先写临时文件再改名，避免中途退出留下不完整的状态
+  const std::string tmp = config_.state_file + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    WritePod(out, kStateMagic);
+    WritePod(out, kStateVersion);
+    WriteString(out, model_path_);
+    WritePod(out, uint32_t(kv_entries_.size()));
+    for (const auto& entry : kv_entries_) {
+      WriteString(out, entry);
+    }
+    WritePod(out, uint32_t(kv_tokens_.size()));
+    out.write(reinterpret_cast<const char*>(kv_tokens_.data()),
+              kv_tokens_.size() * sizeof(llama_token));
+    WritePod(out, uint64_t(state.size()));
+    out.write(reinterpret_cast<const char*>(state.data()), state.size());
+    if (!out) {
+      LOG(WARNING) << "[LLM] failed to write state: " << tmp;
       return false;
     }
+  }
+  if (std::rename(tmp.c_str(), config_.state_file.c_str()) != 0) {
+    LOG(WARNING) << "[LLM] failed to save state: " << config_.state_file;
+    std::remove(tmp.c_str());
+    return false;
+  }
+  LOG(INFO) << "[LLM] saved " << kv_tokens_.size() << " tokens (" << state.size() / 1024
+            << " KiB) to " << config_.state_file << " in " << (llama_time_us() - t_start_us) / 1000
+            << " ms";
+  return true;
+}
 
-    n_pos += batch.n_tokens;
-    new_token_id = llama_sampler_sample(sampler_, ctx_, -1);
+bool ClientSimple::RestoreState() {
+  if (config_.state_file.empty()) {
+    return false;
+  }
+  std::ifstream in(config_.state_file, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  in.seekg(0, std::ios::end);
+  const uint64_t file_size = in.tellg();
+  in.seekg(0, std::ios::beg);
+  const int64_t t_start_us = llama_time_us();
+  uint32_t magic = 0, version = 0, n_entries = 0, n_tokens = 0;
+  uint64_t n_state = 0;
+  std::string model;
+  std::vector<std::string> entries;
+  std::vector<llama_token> tokens;
+  // 文件可能被截断或改坏：各长度先按配置和剩余文件大小校验，再分配
+  try {
+    if (!ReadPod(in, &magic) || magic != kStateMagic || !ReadPod(in, &version) ||
+        version != kStateVersion || !ReadString(in, &model) || model != model_path_ ||
+        !ReadPod(in, &n_entries)) {
+      LOG(INFO) << "[LLM] ignoring stale state: " << config_.state_file;
+      return false;
+    }
+    if (int64_t(n_entries) > std::max(1, config_.max_history)) {
+      LOG(WARNING) << "[LLM] invalid state, entries: " << n_entries;
+      return false;
+    }
+    entries.resize(n_entries);
+    for (auto& entry : entries) {
+      if (!ReadString(in, &entry)) {
+        return false;
+      }
+    }
+    if (!ReadPod(in, &n_tokens) || n_tokens == 0 || int64_t(n_tokens) > n_ctx_) {
+      return false;
+    }
+    tokens.resize(n_tokens);
+    if (!in.read(reinterpret_cast<char*>(tokens.data()), n_tokens * sizeof(llama_token)) ||
+        !ReadPod(in, &n_state)) {
+      return false;
+    }
+    const uint64_t remaining = file_size - std::min<uint64_t>(file_size, in.tellg());
+    if (n_state == 0 || n_state != remaining) {
+      LOG(WARNING) << "[LLM] invalid state, size: " << n_state << ", remaining: " << remaining;
+      return false;
+    }
+    std::vector<uint8_t> state(n_state);
+    if (!in.read(reinterpret_cast<char*>(state.data()), n_state) ||
+        llama_state_seq_set_data(ctx_, state.data(), state.size(), 0) == 0) {
+      llama_memory_seq_rm(llama_get_memory(ctx_), 0, -1, -1);
+      LOG(WARNING) << "[LLM] failed to restore state: " << config_.state_file;
+      return false;
+    }
+  } catch (const std::exception& e) {
+    llama_memory_seq_rm(llama_get_memory(ctx_), 0, -1, -1);
+    LOG(WARNING) << "[LLM] failed to restore state: " << config_.state_file << ", " << e.what();
+    return false;
+  }
+  kv_tokens_ = std::move(tokens);
+  kv_entries_ = std::move(entries);
+  LOG(INFO) << "[LLM] restored " << kv_tokens_.size() << " tokens (" << kv_entries_.size()
+            << " entries) from " << config_.state_file << " in "
+            << (llama_time_us() - t_start_us) / 1000 << " ms";
+  return true;
+}
+
+bool ClientSimple::run(const std::vector<std::string>& entries) {
+  const int n_predict = n_predict_;
+  const int64_t t_start_us = llama_time_us();
+  int n_prompt = 0;
+  if (!prefill(entries, &n_prompt)) {
+    return false;
+  }
+  const int64_t t_prompt_us = llama_time_us() - t_start_us;
+
+  int n_generated = 0;
+  char buf[128];
+  std::string response;
+  const int n_vocab = llama_vocab_n_tokens(vocab_);
+  std::vector<llama_token_data> candidates;
+  float confidence = 1.0f;
+  while (n_generated < n_predict) {
+    ++n_generated;
+    float p = 0.0f;
+    llama_token new_token_id =
+        SampleRow(sampler_, llama_get_logits_ith(ctx_, -1), n_vocab, &candidates, &p);
     if (llama_vocab_is_eog(vocab_, new_token_id)) {
       break;
     }
 
     int n = llama_token_to_piece(vocab_, new_token_id, buf, sizeof(buf), 0, true);
     if (stop_) {
+      ++n_cancelled_;
+      n_wasted_tokens_ += n_prompt + n_generated;
       return false;
     }
+    // 提前结束：低置信度的尾巴、短语边界都不计入结果
+    if (confidence * p < config_.min_confidence ||
+        (config_.stop_at_boundary && n > 0 && IsPhraseBoundary(std::string_view(buf, n)))) {
+      break;
+    }
+    confidence *= p;
     response.append(buf, n);
-    batch = llama_batch_get_one(&new_token_id, 1);
+    if (n_generated == n_predict) {
+      break;  // 最后一个 token 无需 decode
+    }
+    kv_tokens_.push_back(new_token_id);
+    if (llama_decode(ctx_, llama_batch_get_one(&kv_tokens_.back(), 1)) != 0) {
+      llama_memory_seq_rm(llama_get_memory(ctx_), 0, -1, -1);
+      kv_tokens_.clear();
+      return false;
+    }
   }
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    stats_.n_prompt = n_prompt;
+    stats_.n_generated = n_generated;
+    stats_.t_prompt_us = t_prompt_us;
+    stats_.t_generate_us = llama_time_us() - t_start_us - t_prompt_us;
+    stats_.confidence = response.empty() ? 0.0f : confidence;
+  }
+  ++n_completed_;
   on_finish_(response);
   return true;
 }
 
+bool ClientSimple::run_score(const std::vector<std::string>& entries,
+                             const std::vector<std::string>& candidates,
+                             const OnScoreCallback& on_score) {
+  constexpr size_t kMaxCandidateTokens = 16;
+  std::vector<float> scores;
+  int n_prompt = 0;
+  if (config_.n_rescore <= 0 || !prefill(entries, &n_prompt)) {
+    on_score(scores);
+    return false;
+  }
+  const int64_t t_start_us = llama_time_us();
+  auto* mem = llama_get_memory(ctx_);
+  const int n_vocab = llama_vocab_n_tokens(vocab_);
+  const llama_pos n_past = kv_tokens_.size();
+  const int n_seq = std::min<int>(candidates.size(), config_.n_rescore);
+
+  // 第一个 token 的概率来自 prompt 最后一个位置，其余 token 在各自的序列上一起 decode
+  std::vector<std::vector<llama_token>> tokens(n_seq);
+  std::vector<double> logprob(n_seq, 0.0);
+  int n_tokens = 0;
+  for (int i = 0; i < n_seq; ++i) {
+    tokens[i] = tokenizer_->tokenize(candidates[i]);
+    if (tokens[i].size() > kMaxCandidateTokens) {
+      tokens[i].resize(kMaxCandidateTokens);
+    }
+    if (!tokens[i].empty()) {
+      logprob[i] = TokenLogProbability(ctx_, -1, tokens[i][0], n_vocab);
+      n_tokens += tokens[i].size() - 1;
+    }
+  }
+
+  bool ok = !stop_;
+  if (!ok) {
+    ++n_cancelled_;
+    n_wasted_tokens_ += n_prompt;
+  } else if (n_tokens > 0) {
+    // 候选按整条分组，每组不超过 n_batch 个 token；读完这组的 logits 再 decode 下一组
+    const int n_batch = llama_n_batch(ctx_);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    int n_decodes = 0;
+    for (int begin = 0; ok && begin < n_seq;) {
+      batch.n_tokens = 0;
+      int end = begin;
+      for (; end < n_seq; ++end) {
+        const int n = std::max<int>(0, tokens[end].size() - 1);
+        if (batch.n_tokens + n > n_batch) {
+          break;
+        }
+        if (n == 0) {
+          continue;
+        }
+        llama_memory_seq_cp(mem, 0, end + 1, -1, -1);
+        for (int j = 0; j < n; ++j) {
+          int k = batch.n_tokens++;
+          batch.token[k] = tokens[end][j];
+          batch.pos[k] = n_past + j;
+          batch.n_seq_id[k] = 1;
+          batch.seq_id[k][0] = end + 1;
+          batch.logits[k] = true;
+        }
+      }
+      if (end == begin) {
+        ok = false;  // 单个候选就超过 n_batch
+        break;
+      }
+      if (batch.n_tokens > 0) {
+        ok = llama_decode(ctx_, batch) == 0;
+        ++n_decodes;
+      }
+      if (ok) {
+        int k = 0;
+        for (int i = begin; i < end; ++i) {
+          for (size_t j = 1; j < tokens[i].size(); ++j, ++k) {
+            logprob[i] += TokenLogProbability(ctx_, k, tokens[i][j], n_vocab);
+          }
+        }
+      }
+      begin = end;
+    }
+    llama_batch_free(batch);
+    for (int i = 0; i < n_seq; ++i) {
+      llama_memory_seq_rm(mem, i + 1, -1, -1);
+    }
+    if (n_decodes > 1) {
+      DLOG(INFO) << "[LLM] rescore split into " << n_decodes << " decodes, n_batch: " << n_batch;
+    }
+  }
+  if (ok) {
+    // 按 token 数归一化：几何平均概率，避免偏向短候选
+    scores.resize(n_seq, 0.0f);
+    for (int i = 0; i < n_seq; ++i) {
+      if (!tokens[i].empty()) {
+        scores[i] = std::exp(logprob[i] / tokens[i].size());
+      }
+    }
+  }
+  DLOG(INFO) << "[LLM] scored " << n_seq << " candidates (" << n_tokens << " tokens) in "
+             << (llama_time_us() - t_start_us) / 1000 << " ms, n_prompt: " << n_prompt;
+  if (ok) {
+    ++n_completed_;
+  }
+  on_score(scores);
+  return ok;
+}
+
 void ClientSimple::clear() {
-  stop_ = true;
-  wait();
+  interrupt();
+  if (loaded_) {
+    wait();
+  }
   stop_ = false;
 }
 
@@ -7,6 +7,14 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
+
+// 采样前限制可选的 token
+enum class VocabMask {
+  kNone = 0,
+  kCJK,       // CJK 字符与中文标点（以及 EOG）
+  kCJKAscii,  // 另加 ASCII 单词、数字与常用标点
+};
 
 struct ClientConfig {
   float temp = -1;
@@ -29,12 +37,31 @@ struct ClientConfig {
   int n_predict = 64;
   bool no_perf = true;
   bool apply_chat_template = false;
+
+  // 提前结束：遇到标点 / 换行即停（不含该 token）；
+  // 或累计概率（各 token 概率之积）将低于 min_confidence 时停在这之前
+  bool stop_at_boundary = false;
+  float min_confidence = 0.0f;
+
+  // 模型加载时扫描词表生成，作为采样链的第一级，之后的采样器只处理保留下来的 token
+  VocabMask vocab_mask = VocabMask::kNone;
+
+  int n_rescore = 0;  // > 0: 额外的 KV 序列数，用于 ClientSimple::score 给候选打分
+
+  // 非空时在空闲释放 / 退出时把 prompt 的 KV 状态及对应的条目存到该文件，下次加载时恢复
+  std::string state_file;
+  int max_history = 10;  // prompt 最多的条目数，恢复状态时据此校验文件
+
+  int idle_unload_seconds = 0;  // > 0: 空闲后释放 context，下次推理时在后台重新加载
+  bool unload_model = false;    // 空闲时同时释放模型权重（含 mmap）
 };
 
 struct BackendConfig {
-  int n_ctx = 0;  // = 0 表示使用模型的上下文大小
+  int n_ctx = 0;  // = 0 表示使用模型的上下文大小，所有序列共享
   int n_batch = 512;
   int n_gpu_layers = 99;
+  int n_seq_max = 4;  // KV 序列数，即可同时存在的 Client 数
+  int n_threads = 0;  // <= 0: hardware concurrency
 
   bool no_perf = true;
   bool flash_attn = true;
@@ -45,16 +72,36 @@ namespace llama {
 
 using StreamCallback = std::function<bool(const std::string_view&)>;
 using OnFinishCallback = std::function<void(const std::string&)>;
+using OnScoreCallback = std::function<void(const std::vector<float>&)>;
 
 class Client;
 
 bool PrintCallback(const std::string_view&);
 
+// 一次 commit 的结果
+enum class Status {
+  kOk = 0,
+  kCancelled,    // 被新的 commit / clear 打断
+  kNoKvSpace,    // KV 已满且无法腾出空间
+  kDecodeError,  // llama_decode 出错
+};
+
+// Backend 的 KV 饱和计数
+struct BackendStats {
+  uint64_t saturated = 0;       // llama_decode 找不到 KV 空位的次数
+  uint64_t evicted = 0;         // 为腾出空间而清空的空闲序列数
+  uint64_t shifted = 0;         // 对活跃序列做 context shift 的次数
+  uint64_t failed_tickets = 0;  // 恢复失败、直接结束的 ticket 数
+};
+
 class LLMManager {
  public:
-  std::unique_ptr<Client> CreateClient(const std::string& model, const std::string& name,
+  // 同一模型的 Client 共享一个 Backend，各占一个 KV 序列；序列用尽时返回 nullptr
+  std::unique_ptr<Client> CreateClient(const BackendConfig& backend, const std::string& name,
                                        const ClientConfig&, StreamCallback callback = PrintCallback,
                                        OnFinishCallback on_finish = nullptr);
+  // 句柄存活期间，即使最后一个 Client 被销毁也保留该模型已加载的 Backend（没有则返回 nullptr）
+  std::shared_ptr<void> Hold(const std::string& model);
 
   static LLMManager& Instance() {
     static LLMManager manager;
@@ -82,6 +129,20 @@ class Client {
   void clear();
   void pop_back();
   void pop_front();
+  // 丢弃上一次生成的 token，保留已 prefill 的 prompt，之后 commit 只需追加新文本。
+  // 返回 false 表示上一次的 prompt 没能写入 KV（例如 KV 已满），需要 clear 后重来
+  bool rewind();
+  void set_n_predict(int n_predict);
+
+  // 序列中的 entry 数（每次 commit 的 prompt、生成结果各一个）与占用的 token 数。
+  // pop_front 丢弃最早的 entry 并把之后的位置前移，用于把序列控制在预算内
+  size_t size() const;
+  int n_tokens() const;
+
+  // 最近一次 commit 的结果（commit 完成后有效）
+  Status status() const;
+  float confidence() const;
+  BackendStats backend_stats() const;
 
   int seq_id() const;
   const std::string& model() const;
@@ -100,31 +161,94 @@ struct llama_vocab;
 struct llama_model;
 struct llama_context;
 struct llama_sampler;
+typedef int32_t llama_token;
 
 namespace llama {
+class PromptTokenizer;
+
 class ClientSimple {
  public:
+  // 最近一次完成的推理统计
+  struct Stats {
+    int n_prompt = 0;
+    int n_generated = 0;
+    int64_t t_prompt_us = 0;
+    int64_t t_generate_us = 0;
+    float confidence = 0.0f;  // 结果中各 token 概率之积
+  };
+  // 累计的调度计数，用于观察被浪费的推理
+  struct Counters {
+    uint64_t submitted = 0;      // commit / score 次数
+    uint64_t debounced = 0;      // 安静期内被新输入取代，没有 decode
+    uint64_t superseded = 0;     // 排队时已被新输入取代，没有 decode
+    uint64_t cancelled = 0;      // decode 开始后被打断
+    uint64_t wasted_tokens = 0;  // 被打断的推理已经 decode 的 token 数
+    uint64_t completed = 0;
+  };
+
   ClientSimple(ClientConfig config, const std::string& model, OnFinishCallback on_finish = nullptr);
   ~ClientSimple();
   void commit(const std::string& prompt = "");
+  // prompt 按 History 条目给出：逐条缓存分词结果，与上次 prompt 相同的 token 前缀复用 KV
+  // delay_ms > 0: 推迟这么久再 decode，期间有新的 commit 则放弃本次（去抖）
+  void commit(std::vector<std::string> entries, int delay_ms = 0);
+  // 给接在 prompt 之后的候选打分（各 token 概率的几何平均，失败时为空）。prompt 的 KV 经
+  // seq_cp 共享给每个候选，所有候选在一次 decode 中完成；最多打分 config.n_rescore 个
+  void score(std::vector<std::string> entries, std::vector<std::string> candidates,
+             OnScoreCallback on_score);
   void wait();
   void clear();
 
+  // 在下一次 commit 时生效
+  void set_n_predict(int n_predict) { n_predict_ = n_predict; }
+  void set_n_threads(int n_threads) { n_threads_ = n_threads; }
+  Stats stats() const;
+  Counters counters() const;
+  // 构造时从 state_file 恢复的 prompt 条目（没有则为空）
+  const std::vector<std::string>& restored_entries() const { return restored_entries_; }
+
  private:
-  bool run(const std::string&);
+  void submit(std::vector<std::string> entries, std::vector<std::string> candidates,
+              OnScoreCallback on_score, int delay_ms);
+  // 打断正在进行或等待中的任务
+  void interrupt();
+  // 仅在 worker 线程调用
+  bool prefill(const std::vector<std::string>& entries, int* n_prompt);
+  bool run(const std::vector<std::string>& entries);
+  bool run_score(const std::vector<std::string>& entries,
+                 const std::vector<std::string>& candidates, const OnScoreCallback& on_score);
+  bool Load();
+  void Unload();
+  bool SaveState() const;
+  bool RestoreState();
 
   ClientConfig config_;
   std::string model_path_;
   OnFinishCallback on_finish_;
 
   int n_ctx_;
+  std::atomic<int> n_predict_;
+  std::atomic<int> n_threads_{0};
+  int applied_threads_ = 0;
+  mutable std::mutex stats_mutex_;
+  Stats stats_;
   std::string response_;
   std::atomic_bool shutdown_ = false;
   std::atomic_bool stop_ = false;
+  std::atomic_bool loaded_ = false;
   std::shared_ptr<std::thread> worker_;
   std::mutex mutex_;
   std::condition_variable cond_;
-  std::string pending_prompt_;
+  std::vector<std::string> pending_prompt_;
+  std::vector<std::string> pending_candidates_;
+  OnScoreCallback pending_on_score_;
+  std::chrono::milliseconds pending_delay_{0};
+  std::atomic<uint64_t> n_submitted_{0};
+  std::atomic<uint64_t> n_debounced_{0};
+  std::atomic<uint64_t> n_superseded_{0};
+  std::atomic<uint64_t> n_cancelled_{0};
+  std::atomic<uint64_t> n_wasted_tokens_{0};
+  std::atomic<uint64_t> n_completed_{0};
   bool has_new_task_ = false;
   std::shared_ptr<std::promise<void>> running_task_;  // 当前运行的任务
   std::shared_future<void> running_future_;
@@ -133,6 +257,12 @@ class ClientSimple {
   llama_context* ctx_ = nullptr;
   llama_sampler* sampler_ = nullptr;
   const llama_vocab* vocab_ = nullptr;
+
+  // 以下仅在 worker 线程访问
+  std::unique_ptr<PromptTokenizer> tokenizer_;
+  std::vector<llama_token> kv_tokens_;  // 当前 KV 中（已 decode）的 token
+  std::vector<std::string> kv_entries_;  // 产生 kv_tokens_ 的 prompt 条目
+  std::vector<std::string> restored_entries_;
 };
 
 }  // namespace llama
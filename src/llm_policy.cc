@@ -0,0 +1,116 @@
+#include "llm_policy.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace rime {
+
+namespace {
+constexpr double kAlpha = 0.2;           // EMA smoothing factor
+constexpr int kMinSuggestions = 20;      // samples before acceptance affects the level
+constexpr double kLowAcceptance = 0.05;  // step down below this
+constexpr int kMaxLevel = 2;
+constexpr int kMinPredict = 2;
+constexpr int kMinHistory = 3;
+
+inline double Ema(double prev, double value, bool first) {
+  return first ? value : prev + kAlpha * (value - prev);
+}
+}  // namespace
+
+LLMPolicy::LLMPolicy(const Config& config) : config_(config) {
+  if (config_.n_threads <= 0) {
+    config_.n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+LLMPolicy::BatteryMode LLMPolicy::ParseBatteryMode(const std::string& mode) {
+  if (mode == "off") {
+    return BatteryMode::kOff;
+  }
+  if (mode == "full") {
+    return BatteryMode::kFull;
+  }
+  return BatteryMode::kReduced;
+}
+
+void LLMPolicy::OnPowerChange(bool is_ac_power) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  is_on_ac_ = is_ac_power;
+}
+
+void LLMPolicy::OnDecode(int n_prompt, int64_t t_prompt_us, int n_generated,
+                         int64_t t_generate_us) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (n_prompt > 0 && t_prompt_us > 0) {
+    prompt_us_ = Ema(prompt_us_, double(t_prompt_us), prompt_us_ == 0);
+  }
+  if (n_generated > 0 && t_generate_us > 0) {
+    double tps = n_generated * 1e6 / double(t_generate_us);
+    tokens_per_second_ = Ema(tokens_per_second_, tps, tokens_per_second_ == 0);
+  }
+}
+
+void LLMPolicy::OnSuggestion(bool accepted) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  acceptance_ = Ema(acceptance_, accepted ? 1.0 : 0.0, n_suggestions_ == 0);
+  ++n_suggestions_;
+}
+
+LLMPolicy::Decision LLMPolicy::Decide() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Decision d;
+  d.n_predict = config_.n_predict;
+  d.max_history = config_.max_history;
+  d.n_threads = config_.n_threads;
+
+  if (!is_on_ac_) {
+    switch (config_.battery_mode) {
+      case BatteryMode::kOff:
+        d.enabled = false;
+        return d;
+      case BatteryMode::kReduced:
+        ++d.level;
+        break;
+      case BatteryMode::kFull:
+        break;
+    }
+  }
+  // 长期无人采纳时，长预测多半是浪费
+  if (n_suggestions_ >= kMinSuggestions && acceptance_ < kLowAcceptance) {
+    ++d.level;
+  }
+  d.level = std::min(d.level, kMaxLevel);
+
+  // 每降一级：预测长度、历史长度、线程数减半
+  for (int i = 0; i < d.level; ++i) {
+    d.n_predict = std::max(kMinPredict, d.n_predict / 2);
+    d.max_history = std::max(kMinHistory, d.max_history / 2);
+    d.n_threads = std::max(1, d.n_threads / 2);
+  }
+
+  // 按实测速度限制预测长度，使一次推理能在时延预算内完成
+  if (tokens_per_second_ > 0 && config_.latency_budget_ms > 0) {
+    double budget_us = config_.latency_budget_ms * 1000.0 - prompt_us_;
+    int affordable = int(std::max(0.0, budget_us) * tokens_per_second_ / 1e6);
+    d.n_predict = std::max(kMinPredict, std::min(d.n_predict, affordable));
+  }
+  return d;
+}
+
+bool LLMPolicy::is_on_ac() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_on_ac_;
+}
+
+double LLMPolicy::acceptance_rate() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return acceptance_;
+}
+
+double LLMPolicy::tokens_per_second() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tokens_per_second_;
+}
+
+}  // namespace rime
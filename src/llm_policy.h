@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace rime {
+
+// 根据电源状态、实测速度与采纳率动态调整 LLM 预测规模
+class LLMPolicy {
+ public:
+  enum struct BatteryMode : uint8_t {
+    kOff = 0,      // 电池供电时关闭 LLM（旧行为）
+    kReduced = 1,  // 电池供电时降级
+    kFull = 2,     // 电池供电时不降级
+  };
+
+  struct Config {
+    int n_predict = 8;
+    int max_history = 10;
+    int n_threads = 0;  // <= 0: hardware concurrency
+    BatteryMode battery_mode = BatteryMode::kReduced;
+    int latency_budget_ms = 200;  // keep in sync with CopilotEngine's retrieve timeout
+  };
+
+  struct Decision {
+    bool enabled = true;
+    int n_predict = 8;
+    int max_history = 10;
+    int n_threads = 1;
+    int level = 0;  // 0 = full quality, larger = cheaper
+  };
+
+  explicit LLMPolicy(const Config& config);
+
+  static BatteryMode ParseBatteryMode(const std::string& mode);
+
+  void OnPowerChange(bool is_ac_power);
+  // 一次推理的耗时统计
+  void OnDecode(int n_prompt, int64_t t_prompt_us, int n_generated, int64_t t_generate_us);
+  // 上一条 LLM 建议是否被采纳
+  void OnSuggestion(bool accepted);
+
+  Decision Decide() const;
+
+  bool is_on_ac() const;
+  double acceptance_rate() const;
+  double tokens_per_second() const;
+
+ private:
+  Config config_;
+  mutable std::mutex mutex_;
+  bool is_on_ac_ = true;
+  double prompt_us_ = 0;          // EMA of prompt processing time
+  double tokens_per_second_ = 0;  // EMA of generation speed
+  double acceptance_ = 0;         // EMA of acceptance
+  int n_suggestions_ = 0;
+};
+
+}  // namespace rime
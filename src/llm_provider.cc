@@ -1,15 +1,45 @@
 #include "llm_provider.h"
 
+#include <algorithm>
+
 #include <glog/logging.h>
 
+#include "ime_bridge.h"
+#include "imk_client.h"
 #include "llm.h"
 #include "utils.h"
 
-#define USE_SIMPLE_CLIENT
-
 namespace rime {
 
 namespace {
+constexpr const char* kDefaultClientKey = "default";
+
+// 当前输入所在的客户端，每个客户端占一个 KV 序列；识别不了时共用默认序列
+std::string CurrentClientKey() {
+#ifdef __APPLE__
+  if (auto context = GetIMKSurroundingText()) {
+    if (!context->client_key.empty()) {
+      return context->client_key;
+    }
+  }
+#endif
+  auto client = ImeBridgeServer::Instance().GetActiveClient();
+  return client.empty() ? kDefaultClientKey : client;
+}
+
+VocabMask ParseVocabMask(const std::string& mask) {
+  if (mask == "cjk") {
+    return VocabMask::kCJK;
+  }
+  if (mask == "cjk_ascii") {
+    return VocabMask::kCJKAscii;
+  }
+  if (mask != "none") {
+    LOG(WARNING) << "[LLM] unknown vocab_mask: '" << mask << "'";
+  }
+  return VocabMask::kNone;
+}
+
 inline std::string StripAndNormalize(const std::string& input) {
   size_t start = 0;
   size_t end = input.size();
@@ -42,47 +72,115 @@ inline std::string StripAndNormalize(const std::string& input) {
 LLMProvider::LLMProvider(const Config& c, const std::shared_ptr<::copilot::History>& history)
     : config_(c), history_(history) {
   --config_.rank;
-#ifdef USE_SIMPLE_CLIENT
-  ClientConfig config;
-  config.n_predict = c.n_predict;
-  LOG(INFO) << "LLM model: '" << config_.model << "', n_predict:" << config_.n_predict
-            << ", rank:" << config_.rank;
-  client_ = std::make_unique<llama::ClientSimple>(config, config_.model,
-                                                  [this](const std::string& response) {
-                                                    if (promise_) {
-                                                      promise_->set_value(response);
-                                                    }
-                                                  });
-  client_->commit("WarmUp");
-  client_->clear();
-#else
-  session_ = CreateSession("copilot");
-  Predict("WarmUp");
-  Clear(session_);
-#endif
-  if (!config_.battery_active) {
-    is_on_ac_ = copilot::IsACPowerConnected();
-    copilot::RegisterPowerChange([this](bool is_ac_power) {
-      if (is_ac_power != is_on_ac_) {
-        is_on_ac_ = is_ac_power;
-        DLOG(INFO) << "[LLM]: AC Power Connected:" << is_on_ac_;
-      }
+  LLMPolicy::Config policy_config;
+  policy_config.n_predict = config_.n_predict;
+  policy_config.max_history = config_.max_history;
+  policy_config.n_threads = config_.n_threads;
+  policy_config.latency_budget_ms = config_.latency_budget_ms;
+  policy_config.battery_mode = config_.battery_active
+                                   ? LLMPolicy::BatteryMode::kFull
+                                   : LLMPolicy::ParseBatteryMode(config_.battery_mode);
+  policy_ = std::make_unique<LLMPolicy>(policy_config);
+  if (config_.max_sessions < 1) {
+    config_.max_sessions = 1;
+  }
+  // 每个候选占一个 KV 序列
+  constexpr int kMaxRescoreTopK = 32;
+  if (config_.rescore_top_k > kMaxRescoreTopK) {
+    LOG(WARNING) << "[LLM] rescore_top_k: " << config_.rescore_top_k << " clamped to "
+                 << kMaxRescoreTopK;
+    config_.rescore_top_k = kMaxRescoreTopK;
+  }
+  rescore_ = config_.mode == "rescore" && config_.rescore_top_k > 0;
+  if (rescore_ && config_.backend == "multi") {
+    LOG(WARNING) << "[LLM] mode: rescore requires backend: simple, falling back to generate";
+    rescore_ = false;
+  }
+  if (config_.backend == "multi") {
+    LOG(INFO) << "LLM model: '" << config_.model << "', backend: multi, max_sessions:"
+              << config_.max_sessions << ", n_ctx:" << config_.n_ctx << ", rank:" << config_.rank;
+    // 预热：加载模型并完成一次 decode
+    if (auto session = GetOrCreateSession(kDefaultClientKey)) {
+      session->client->commit("WarmUp", /* async = */ false);
+      Clear(session);
+    }
+  } else {
+    ClientConfig config;
+    config.n_predict = c.n_predict;
+    config.stop_at_boundary = c.stop_at_boundary;
+    config.min_confidence = c.min_confidence;
+    config.idle_unload_seconds = c.idle_unload_seconds;
+    config.unload_model = c.unload_model;
+    config.n_rescore = rescore_ ? config_.rescore_top_k : 0;
+    config.vocab_mask = ParseVocabMask(config_.vocab_mask);
+    config.state_file = c.state_file;
+    config.max_history = c.max_history;
+    LOG(INFO) << "LLM model: '" << config_.model << "', n_predict:" << config_.n_predict
+              << ", rank:" << config_.rank << ", idle_unload_seconds:" << c.idle_unload_seconds
+              << ", mode:" << (rescore_ ? "rescore" : "generate");
+    client_ = std::make_unique<llama::ClientSimple>(config, config_.model,
+                                                    [this](const std::string& response) {
+                                                      if (promise_) {
+                                                        promise_->set_value(response);
+                                                      }
+                                                    });
+    // 恢复上次的历史，并用它预热：与恢复的 KV 相同的前缀不必重新 decode
+    auto restored = client_->restored_entries();
+    for (const auto& entry : restored) {
+      history_->add(entry);
+    }
+    client_->commit(restored.empty() ? std::vector<std::string>{"WarmUp"} : restored);
+    client_->wait();
+  }
+  if (policy_config.battery_mode != LLMPolicy::BatteryMode::kFull) {
+    policy_->OnPowerChange(::copilot::IsACPowerConnected());
+    ::copilot::RegisterPowerChange([this](bool is_ac_power) {
+      policy_->OnPowerChange(is_ac_power);
+      DLOG(INFO) << "[LLM]: AC Power Connected:" << is_ac_power;
     });
   }
 }
 
 LLMProvider::~LLMProvider() {}
 
-void LLMProvider::Backspace(const std::shared_ptr<Session>& session) {}
+void LLMProvider::Backspace(const std::shared_ptr<Session>& session) {
+  // 上下文已被编辑，KV 中的内容不再可信
+  session->history->clear();
+  Clear(session);
+}
 
-void LLMProvider::Commit(const std::string& input, const std::shared_ptr<Session>& session) {
-  std::string prompt = history_->gets(config_.max_history);
-  DLOG(INFO) << "[LLM] Prompt: '" << prompt << "'";
+bool LLMProvider::Commit(const std::string& input, const std::shared_ptr<Session>& session,
+                         const LLMPolicy::Decision& decision) {
+  session->last_used = ++session_clock_;
+  session->history->add(input);
+  session->pending.append(input);
+  if (!decision.enabled || session->history->size() < 3) {
+    return false;
+  }
+  auto& client = session->client;
+  std::string text;
+  if (session->primed && client->rewind()) {
+    // 滑动窗口：丢弃最早的 entry 并前移后面的 KV，只 prefill 新提交的文本
+    while (client->size() > 0 && (client->size() >= size_t(decision.max_history) ||
+                                  client->n_tokens() > config_.max_context_tokens)) {
+      client->pop_front();
+    }
+    text = session->pending;
+  } else {
+    client->clear();
+    text = session->history->gets(decision.max_history);
+  }
+  DLOG(INFO) << "[LLM] Prefill: '" << text << "', entries:" << client->size()
+             << ", n_tokens:" << client->n_tokens() << ", level:" << decision.level
+             << ", n_predict:" << decision.n_predict;
+  session->pending.clear();
+  session->primed = true;
   session->response.clear();
   session->promise = std::make_shared<std::promise<std::string>>();
   session->future = session->promise->get_future().share();
-  session->client->clear();
-  session->client->commit(prompt, /* async = */ true);
+  client->set_n_predict(decision.n_predict);
+  client->commit(text, /* async = */ true);
+  return true;
 }
 
 std::string LLMProvider::GetResults(const std::shared_ptr<LLMProvider::Session>& session,
@@ -95,6 +193,12 @@ std::string LLMProvider::GetResults(const std::shared_ptr<LLMProvider::Session>&
   }
   if (future.wait_for(std::chrono::microseconds(timeout_us)) != std::future_status::timeout) {
     response = StripAndNormalize(future.get());
+    if (session->client->status() != llama::Status::kOk) {
+      auto stats = session->client->backend_stats();
+      DLOG(INFO) << "[LLM] prediction failed: " << int(session->client->status())
+                 << ", saturated:" << stats.saturated << ", evicted:" << stats.evicted
+                 << ", shifted:" << stats.shifted << ", failed:" << stats.failed_tickets;
+    }
     // LOG(INFO) << "[LLM] response: '" << response << "'";
   }
   return response;
@@ -116,16 +220,29 @@ std::shared_ptr<LLMProvider::Session> LLMProvider::CreateSession(const std::stri
   config.apply_chat_template = false;
   config.n_predict = config_.n_predict;
   config.no_perf = false;
+  config.stop_at_boundary = config_.stop_at_boundary;
+  config.min_confidence = config_.min_confidence;
+  config.vocab_mask = ParseVocabMask(config_.vocab_mask);
+
+  BackendConfig backend;
+  backend.model_path = config_.model;
+  backend.n_ctx = config_.n_ctx;
+  backend.n_seq_max = config_.max_sessions;
+  backend.n_threads = config_.n_threads;
 
   auto& manager = llama::LLMManager::Instance();
   std::weak_ptr<Session> weak_session = session;
-  session->client = manager.CreateClient(config_.model, app_id, config, nullptr,
+  session->client = manager.CreateClient(backend, app_id, config, nullptr,
                                          [weak_session](const std::string& response) {
-                                           if (auto session = weak_session.lock()) {
+                                           auto session = weak_session.lock();
+                                           if (session && session->promise) {
                                              session->promise->set_value(response);
                                            }
                                          });
-
+  if (!session->client) {
+    return nullptr;
+  }
+  DLOG(INFO) << "[LLM] new session: '" << app_id << "', seq_id:" << session->client->seq_id();
   return session;
 }
 
@@ -134,53 +251,236 @@ std::shared_ptr<LLMProvider::Session> LLMProvider::GetOrCreateSession(const std:
   if (it != sessions_.end()) {
     return it->second;
   }
+  // 淘汰最后一个客户端时 Backend 会随之卸载；先持有它，让新客户端直接复用已加载的模型
+  auto hold = llama::LLMManager::Instance().Hold(config_.model);
+  if (sessions_.size() >= size_t(config_.max_sessions)) {
+    EvictSession();
+  }
   auto session = CreateSession(app_id);
+  if (!session) {
+    return nullptr;
+  }
   return sessions_.emplace(app_id, session).first->second;
 }
 
-void LLMProvider::Clear(const std::shared_ptr<Session>& session) { session->client->clear(); }
+void LLMProvider::EvictSession() {
+  // 淘汰最久未用的客户端，释放它的 KV 序列
+  auto lru = sessions_.end();
+  for (auto it = sessions_.begin(); it != sessions_.end(); ++it) {
+    if (lru == sessions_.end() || it->second->last_used < lru->second->last_used) {
+      lru = it;
+    }
+  }
+  if (lru == sessions_.end()) {
+    return;
+  }
+  DLOG(INFO) << "[LLM] evict session: '" << lru->first << "'";
+  if (session_ == lru->second) {
+    session_.reset();
+  }
+  sessions_.erase(lru);
+}
+
+void LLMProvider::Clear(const std::shared_ptr<Session>& session) {
+  session->client->clear();
+  session->pending.clear();
+  session->primed = false;
+  session->future = {};
+}
+
+void LLMProvider::Clear() {
+  // 不视为拒绝：空格选词时会先 Clear 再提交
+  future_ = {};
+  scores_ = {};
+  if (session_) {
+    session_->future = {};
+  }
+}
+
+void LLMProvider::OnBackspace() {
+  if (session_) {
+    Backspace(session_);
+  }
+}
 
 bool LLMProvider::Predict(const std::string& input) {
-  if (!is_on_ac_) {
+  if (!last_response_.empty()) {
+    // 选中任一前缀候选都算采纳
+    policy_->OnSuggestion(!input.empty() && last_response_.compare(0, input.size(), input) == 0);
+    last_response_.clear();
+  }
+  future_ = {};
+  scores_ = {};
+  if (rescore_) {
+    return false;  // 在 Rescore 中对其他 provider 的候选打分
+  }
+  auto decision = policy_->Decide();
+  if (!client_) {
+    auto session = GetOrCreateSession(CurrentClientKey());
+    if (!session) {
+      return false;
+    }
+    session_ = session;
+    // 即使本次不预测也要记录提交，之后作为增量写入 KV
+    return Commit(input, session, decision);
+  }
+  if (!decision.enabled) {
     return false;
   }
-#ifdef USE_SIMPLE_CLIENT
   if (history_->size() < 3) {
     return false;
   }
-  std::string prompt = history_->gets(config_.max_history);
-  DLOG(INFO) << "[LLM] Predict: '" << prompt << "'";
+  DLOG(INFO) << "[LLM] Predict: '" << history_->gets(decision.max_history)
+             << "', level:" << decision.level
+             << ", n_predict:" << decision.n_predict << ", n_threads:" << decision.n_threads;
   client_->clear();
+  client_->set_n_predict(decision.n_predict);
+  client_->set_n_threads(decision.n_threads);
   promise_ = std::make_shared<std::promise<std::string>>();
   future_ = promise_->get_future().share();
-  client_->commit(prompt);
-  return true;
-#else
-  Commit(input, session_);
+  stats_reported_ = false;
+  debounced_ = delay_ms_ > 0;
+  client_->commit(history_->entries(decision.max_history), delay_ms_);
+  if (++n_predictions_ % 64 == 0) {
+    auto counters = client_->counters();
+    LOG(INFO) << "[LLM] submitted:" << counters.submitted << ", debounced:" << counters.debounced
+              << ", superseded:" << counters.superseded << ", cancelled:" << counters.cancelled
+              << ", wasted_tokens:" << counters.wasted_tokens
+              << ", completed:" << counters.completed;
+  }
   return true;
-#endif
 }
 
-std::vector<copilot::Entry> LLMProvider::Retrive(int timeout_us) const {
-  if (!is_on_ac_) {
+void LLMProvider::Rescore(const std::vector<::copilot::Entry>& candidates) {
+  scores_ = {};
+  rescore_candidates_.clear();
+  auto decision = policy_->Decide();
+  if (!client_ || !decision.enabled || candidates.size() < 2 || history_->size() < 1) {
+    return;
+  }
+  size_t n = std::min<size_t>(candidates.size(), config_.rescore_top_k);
+  rescore_candidates_.assign(candidates.begin(), candidates.begin() + n);
+  std::vector<std::string> texts;
+  for (const auto& entry : rescore_candidates_) {
+    texts.push_back(entry.text);
+  }
+  auto promise = std::make_shared<std::promise<std::vector<float>>>();
+  scores_ = promise->get_future().share();
+  client_->set_n_threads(decision.n_threads);
+  client_->score(history_->entries(decision.max_history), std::move(texts),
+                 [promise](const std::vector<float>& scores) { promise->set_value(scores); });
+}
+
+std::vector<::copilot::Entry> LLMProvider::GetRescored(int timeout_us) const {
+  if (!scores_.valid() ||
+      scores_.wait_for(std::chrono::microseconds(timeout_us)) == std::future_status::timeout) {
     return {};
   }
-#ifdef USE_SIMPLE_CLIENT
-  if (!future_.valid()) {
+  const auto& scores = scores_.get();
+  if (scores.size() != rescore_candidates_.size()) {
     return {};
   }
+  // 按 LLM 给出的概率排序，分数相同时保持原来的顺序
+  auto entries = rescore_candidates_;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    entries[i].weight = scores[i];
+  }
+  std::stable_sort(
+      entries.begin(), entries.end(),
+      [](const ::copilot::Entry& a, const ::copilot::Entry& b) { return a.weight > b.weight; });
+  return entries;
+}
+
+std::vector<::copilot::Entry> LLMProvider::Retrive(int timeout_us) const {
+  if (rescore_) {
+    return GetRescored(timeout_us);
+  }
   std::string response;
-  if (future_.wait_for(std::chrono::microseconds(timeout_us)) != std::future_status::timeout) {
-    response = StripAndNormalize(future_.get());
+  if (!client_) {
+    if (!session_) {
+      return {};
+    }
+    response = GetResults(session_, timeout_us);
+    confidence_ = session_->client->confidence();
+  } else {
+    if (!future_.valid()) {
+      return {};
+    }
+    // 推迟了安静期的提交不等：DB 候选照常同步给出，下一次提交到来时这次就不必 decode；
+    // 结果在之后重建菜单时取用
+    const int wait_us = debounced_ ? 0 : timeout_us;
+    if (future_.wait_for(std::chrono::microseconds(wait_us)) != std::future_status::timeout) {
+      response = StripAndNormalize(future_.get());
+      if (!stats_reported_) {
+        stats_reported_ = true;
+        auto stats = client_->stats();
+        policy_->OnDecode(stats.n_prompt, stats.t_prompt_us, stats.n_generated,
+                          stats.t_generate_us);
+        confidence_ = stats.confidence;
+      }
+    }
   }
-#else
-  auto response = GetResults(session_, timeout_us);
-#endif
-  DLOG(INFO) << "[LLM] response: '" << response << "'";
-  if (response.empty()) {
+  DLOG(INFO) << "[LLM] response: '" << response << "', confidence: " << confidence_;
+  if (response.empty() || confidence_ < config_.min_confidence) {
     return {};
   }
-  return {copilot::Entry{response, 4.0, copilot::ProviderType::kLLM}};
+  last_response_ = response;
+  if (config_.max_splits > 0) {
+    return Split(response, confidence_);
+  }
+  return {::copilot::Entry{response, confidence_, ::copilot::ProviderType::kLLM}};
+}
+
+std::vector<::copilot::Entry> LLMProvider::Split(const std::string& response, double weight) const {
+  constexpr size_t kMaxDbPrefixChars = 8;  // 词库查询只看较短的前缀
+  ::copilot::UTF8 chars(response);
+  std::vector<size_t> ends;  // 前缀的字节长度，由短到长
+  size_t offset = 0;
+  size_t db_end = 0;     // 词库中最长的多字前缀
+  bool in_split = true;  // 前一个字符是切分字符（或在开头）
+  for (size_t i = 0; i < chars.size() && ends.size() < size_t(config_.max_splits); ++i) {
+    auto c = chars[i];
+    if (::copilot::IsPunct(c)) {  // 前缀候选在空白与标点处切分
+      if (!in_split) {
+        ends.push_back(offset);
+      }
+      in_split = true;
+    } else {
+      in_split = false;
+      // 单字几乎都是词库的 key，只在有后继的多字词后切分；
+      // 较短的匹配是更长匹配的前缀，只保留最长的
+      if (db_ && config_.split_with_db && i > 0 && i + 1 < chars.size() &&
+          i < kMaxDbPrefixChars) {
+        auto* candidates = db_->Lookup(response.substr(0, offset + c.size()));
+        if (candidates && candidates->size > 0) {
+          db_end = offset + c.size();
+        }
+      }
+    }
+    offset += c.size();
+  }
+  if (db_end > 0) {
+    auto pos = std::lower_bound(ends.begin(), ends.end(), db_end);
+    if (pos == ends.end() || *pos != db_end) {
+      ends.insert(pos, db_end);
+    }
+    if (ends.size() > size_t(config_.max_splits)) {
+      ends.resize(config_.max_splits);
+    }
+  }
+  std::vector<::copilot::Entry> entries;
+  for (size_t end : ends) {
+    if (entries.empty() || entries.back().text.size() < end) {
+      entries.push_back({response.substr(0, end), 0, ::copilot::ProviderType::kLLM});
+    }
+  }
+  entries.push_back({response, 0, ::copilot::ProviderType::kLLM});
+  // 越短越可能被采纳：由短到长依次衰减
+  for (auto& entry : entries) {
+    entry.weight = weight;
+    weight *= config_.split_decay;
+  }
+  return entries;
 }
 
 }  // namespace rime
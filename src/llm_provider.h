@@ -5,7 +5,9 @@
 #include <string>
 #include <unordered_map>
 
+#include "copilot_db.h"
 #include "history.h"
+#include "llm_policy.h"
 #include "provider.h"
 
 namespace llama {
@@ -22,27 +24,61 @@ class LLMProvider : public Provider {
     int max_history = 10;
     int n_predict = 8;
     int rank = 5;
-    bool battery_active = false;
+    bool battery_active = false;           // 等价于 battery_mode: full
+    std::string battery_mode = "reduced";  // off | reduced | full
+    int n_threads = 0;                     // <= 0: hardware concurrency
+    int latency_budget_ms = 200;
+    int idle_unload_seconds = 0;           // 0: 常驻内存
+    bool unload_model = false;             // 空闲时也释放模型权重
+    std::string backend = "simple";        // simple | multi: 每个客户端一个 KV 序列
+    int max_sessions = 4;                  // multi: 同时保留上下文的客户端数
+    int n_ctx = 4096;                      // multi: 所有序列共享的 KV 大小
+    int max_context_tokens = 512;          // multi: 每个序列的 token 预算，超出时丢弃最早的提交
+    bool stop_at_boundary = false;         // 生成到标点 / 换行即停
+    double min_confidence = 0;             // 累计概率低于此值时截断，结果为空则不显示
+    int max_splits = 0;         // 额外给出的前缀候选数（在标点 / 空格 / 词库词处切分），0 不切分
+    double split_decay = 0.8;   // 每长一级前缀，权重乘以该系数
+    bool split_with_db = false;  // 也在 CopilotDb 中最长的多字词后切分
+    std::string mode = "generate";  // generate | rescore: 不生成，只给其他 provider 的候选重新排序
+    int rescore_top_k = 8;          // rescore: 参与打分的候选数
+    std::string vocab_mask = "none";  // none | cjk | cjk_ascii: 只从这些 token 中采样
+    std::string state_file;           // 保存 / 恢复 prompt 的 KV 状态与历史，空则不保存
   };
   LLMProvider(const Config& config, const std::shared_ptr<::copilot::History>& history);
   virtual ~LLMProvider();
 
+  // split_with_db 使用的词库
+  void set_db(const std::shared_ptr<CopilotDb>& db) { db_ = db; }
+
   // 提交输入，异步发起推理
-  void Commit(const std::string& input, const std::string& app_id) {
-    Commit(input, GetOrCreateSession(app_id));
+  bool Commit(const std::string& input, const std::string& app_id) {
+    auto session = GetOrCreateSession(app_id);
+    return session && Commit(input, session, policy_->Decide());
   }
 
   // 获取最近推理完成的结果
   std::string GetCurrentResults(int timeout_us, const std::string& app_id) const;
 
-  void Clear(const std::string& app_id) { Clear(GetOrCreateSession(app_id)); }
-  void Backspace(const std::string& app_id) { Backspace(GetOrCreateSession(app_id)); }
+  void Clear(const std::string& app_id) {
+    if (auto session = GetOrCreateSession(app_id)) {
+      Clear(session);
+    }
+  }
+  void Backspace(const std::string& app_id) {
+    if (auto session = GetOrCreateSession(app_id)) {
+      Backspace(session);
+    }
+  }
 
   // Provider interface
-  void OnBackspace() override {}
+  void OnBackspace() override;
+  void Clear() override;
   int Rank() const override { return config_.rank; }
   bool Predict(const std::string& input) override;
+  void SetDelay(int delay_ms) override { delay_ms_ = delay_ms; }
   std::vector<::copilot::Entry> Retrive(int timeout_us) const override;
+  bool IsRescorer() const override { return rescore_; }
+  void Rescore(const std::vector<::copilot::Entry>& candidates) override;
 
  private:
   struct Session {
@@ -51,28 +87,47 @@ class LLMProvider : public Provider {
     std::shared_ptr<std::promise<std::string>> promise;
     std::shared_future<std::string> future;
     std::string response;
-    // 可以加更多，比如：
-    // uint64_t last_update_time;
+    std::string pending;  // 已提交但尚未写入 KV 的文本
+    bool primed = false;  // KV 中已有该客户端的上下文
+    uint64_t last_used = 0;
   };
 
   void Clear(const std::shared_ptr<Session>& session);
   void Backspace(const std::shared_ptr<Session>& session);
-  void Commit(const std::string& input, const std::shared_ptr<Session>& session);
+  bool Commit(const std::string& input, const std::shared_ptr<Session>& session,
+              const LLMPolicy::Decision& decision);
   std::string GetResults(const std::shared_ptr<Session>& session, int timeout_us) const;
   std::shared_ptr<Session> CreateSession(const std::string& app_id);
   std::shared_ptr<Session> GetOrCreateSession(const std::string& app_id);
+  void EvictSession();
+  // 把一次生成切成由短到长的嵌套前缀候选
+  std::vector<::copilot::Entry> Split(const std::string& response, double weight) const;
+  std::vector<::copilot::Entry> GetRescored(int timeout_us) const;
 
   std::unordered_map<std::string, std::shared_ptr<Session>> sessions_;
+  uint64_t session_clock_ = 0;
 
   std::shared_ptr<Session> session_;
   std::shared_ptr<::copilot::History> history_;
+  std::shared_ptr<CopilotDb> db_;
 
   Config config_;
-  std::atomic<bool> is_on_ac_{true};
+  std::unique_ptr<LLMPolicy> policy_;
+  // 最近一次展示给用户的 LLM 结果，用于统计采纳率
+  mutable std::string last_response_;
+  mutable bool stats_reported_ = true;
+  mutable double confidence_ = 0;
+  int delay_ms_ = 0;
+  bool debounced_ = false;  // 当前预测在安静期之后才开始，Retrive 不等它
+  uint64_t n_predictions_ = 0;
 
   std::unique_ptr<llama::ClientSimple> client_;
   std::shared_ptr<std::promise<std::string>> promise_;
   std::shared_future<std::string> future_;
+
+  bool rescore_ = false;
+  std::vector<::copilot::Entry> rescore_candidates_;  // 正在打分的候选
+  std::shared_future<std::vector<float>> scores_;
 };
 
 }  // namespace rime
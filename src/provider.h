@@ -9,6 +9,8 @@ namespace copilot {
 enum struct ProviderType : uint8_t {
   kLLM = 0,
   kDB = 1,
+  kSession = 2,
+  kDocument = 3,
 };
 
 static inline std::ostream& operator<<(std::ostream& os, ProviderType type) {
@@ -17,6 +19,10 @@ static inline std::ostream& operator<<(std::ostream& os, ProviderType type) {
       return os << "LLM";
     case ProviderType::kDB:
       return os << "DB";
+    case ProviderType::kSession:
+      return os << "Session";
+    case ProviderType::kDocument:
+      return os << "Document";
     default:
       return os << "Unknown";
   }
@@ -42,8 +48,17 @@ class Provider {
 
   virtual void OnBackspace() {}
   virtual void Clear() {}
+  // >= 0：候选固定插在菜单下标 Rank() 处（配置中的 rank 从 1 起，provider 自行减一）；
+  // < 0：与其他候选一起按权重排序
   virtual int Rank() const { return -1; }
   virtual bool Predict(const std::string& input) = 0;
+  // 异步 provider：下一次 Predict 推迟 delay_ms 再开始推理，期间再次 Predict 则只推理最新的
+  virtual void SetDelay(int delay_ms) {}
+
+  // 重排器：不自己给出候选，而是对其他 provider 的候选重新打分；
+  // Rescore 之后 Retrive 返回重排后的候选（为空表示保持原顺序）
+  virtual bool IsRescorer() const { return false; }
+  virtual void Rescore(const std::vector<::copilot::Entry>& candidates) {}
 
   virtual std::vector<::copilot::Entry> Retrive(int timeout_us) const = 0;
 
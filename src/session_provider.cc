@@ -0,0 +1,155 @@
+#include "session_provider.h"
+
+#include <algorithm>
+#include <functional>
+
+#include <glog/logging.h>
+
+namespace rime {
+
+namespace {
+constexpr double kBackoff = 0.4;  // 上下文每短一个提交，分数乘以该系数
+
+inline uint64_t HashCombine(uint64_t seed, uint64_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+}  // namespace
+
+SessionProvider::SessionProvider(const Config& config) : config_(config) {
+  --config_.rank;
+  config_.order = std::max(1, config_.order);
+  config_.max_entries = std::max(config_.order + 1, config_.max_entries);
+  if (config_.max_candidates <= 0) {
+    config_.max_candidates = 3;
+  }
+  LOG(INFO) << "[Session] order:" << config_.order << ", max_entries:" << config_.max_entries
+            << ", rank:" << config_.rank;
+}
+
+bool SessionProvider::ContextKey(size_t end, int n, uint64_t* key) const {
+  if (end < size_t(n)) {
+    return false;
+  }
+  // 从近到远逐个提交滚动哈希，长度也计入 key
+  uint64_t h = n;
+  for (size_t i = end - n; i < end; ++i) {
+    if (stream_[i].empty()) {
+      return false;
+    }
+    h = HashCombine(h, std::hash<std::string>{}(stream_[i]));
+  }
+  *key = h;
+  return true;
+}
+
+void SessionProvider::Update(uint64_t key, const std::string& text, int delta) {
+  auto it = table_.find(key);
+  if (it == table_.end()) {
+    if (delta < 0) {
+      return;
+    }
+    it = table_.emplace(key, Node{}).first;
+  }
+  auto& node = it->second;
+  auto next = std::find_if(node.next.begin(), node.next.end(),
+                           [&](const Continuation& c) { return c.text == text; });
+  if (delta > 0) {
+    if (next == node.next.end()) {
+      node.next.push_back({text, 0});
+      next = std::prev(node.next.end());
+    }
+    next->count += delta;
+    node.total += delta;
+    return;
+  }
+  if (next == node.next.end()) {
+    return;
+  }
+  uint32_t n = std::min<uint32_t>(next->count, -delta);
+  next->count -= n;
+  node.total -= n;
+  if (next->count == 0) {
+    node.next.erase(next);
+  }
+  if (node.next.empty()) {
+    table_.erase(it);
+  }
+}
+
+void SessionProvider::Add(const std::string& text) {
+  stream_.push_back(text);
+  if (!text.empty()) {
+    size_t end = stream_.size() - 1;
+    uint64_t key;
+    for (int n = 1; n <= config_.order && ContextKey(end, n, &key); ++n) {
+      Update(key, text, 1);
+    }
+  }
+  while (stream_.size() > size_t(config_.max_entries)) {
+    Evict();
+  }
+}
+
+void SessionProvider::Evict() {
+  // 每个 n-gram 在它最早的提交被淘汰时移除，
+  // 即以 stream_[0, j) 为上下文、stream_[j] 为后续的那些
+  uint64_t key;
+  for (int j = 1; j <= config_.order && size_t(j) < stream_.size(); ++j) {
+    if (!stream_[j].empty() && ContextKey(j, j, &key)) {
+      Update(key, stream_[j], -1);
+    }
+  }
+  stream_.pop_front();
+}
+
+void SessionProvider::Lookup() {
+  std::unordered_map<std::string, double> scores;
+  uint64_t key;
+  double backoff = 1.0;
+  // 长上下文优先，短上下文的分数按 kBackoff 衰减
+  for (int n = config_.order; n >= 1; --n) {
+    if (ContextKey(stream_.size(), n, &key)) {
+      auto it = table_.find(key);
+      if (it != table_.end()) {
+        const auto& node = it->second;
+        for (const auto& next : node.next) {
+          double score = backoff * next.count / node.total;
+          auto& s = scores[next.text];
+          s = std::max(s, score);
+        }
+      }
+    }
+    backoff *= kBackoff;
+  }
+  candidates_.clear();
+  for (auto& [text, score] : scores) {
+    candidates_.push_back({text, score, ::copilot::ProviderType::kSession});
+  }
+  std::sort(candidates_.begin(), candidates_.end(),
+            [](const ::copilot::Entry& a, const ::copilot::Entry& b) {
+              return a.weight > b.weight || (a.weight == b.weight && a.text < b.text);
+            });
+  if (candidates_.size() > size_t(config_.max_candidates)) {
+    candidates_.resize(config_.max_candidates);
+  }
+}
+
+bool SessionProvider::Predict(const std::string& input) {
+  candidates_.clear();
+  if (input.empty()) {
+    return false;
+  }
+  Add(input);
+  Lookup();
+  return !candidates_.empty();
+}
+
+void SessionProvider::OnBackspace() {
+  candidates_.clear();
+  // 上下文被编辑：之后的提交不与之前的连成 n-gram
+  if (!stream_.empty() && !stream_.back().empty()) {
+    Add("");
+  }
+}
+
+}  // namespace rime
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "provider.h"
+
+namespace rime {
+
+// 本次会话中提交过的短语：以最近 order 个提交为上下文，给出之前在同样上下文之后提交过的内容。
+// 只统计最近 max_entries 个提交，更早的提交连同它们的 n-gram 一起淘汰
+class SessionProvider : public Provider {
+ public:
+  struct Config {
+    int rank = 1;
+    int order = 3;           // 上下文最多包含的提交数
+    int max_entries = 2000;  // 保留的提交数
+    int max_candidates = 3;
+  };
+  explicit SessionProvider(const Config& config);
+  virtual ~SessionProvider() = default;
+
+  void OnBackspace() override;
+  void Clear() override { candidates_.clear(); }
+  int Rank() const override { return config_.rank; }
+  bool Predict(const std::string& input) override;
+  std::vector<::copilot::Entry> Retrive(int timeout_us) const override { return candidates_; }
+
+ private:
+  struct Continuation {
+    std::string text;
+    uint32_t count = 0;
+  };
+  struct Node {
+    uint32_t total = 0;
+    std::vector<Continuation> next;
+  };
+
+  // stream_[end - n, end) 作为上下文的 key；包含断点时返回 false
+  bool ContextKey(size_t end, int n, uint64_t* key) const;
+  void Update(uint64_t key, const std::string& text, int delta);
+  void Add(const std::string& text);
+  void Evict();
+  void Lookup();
+
+  Config config_;
+  std::deque<std::string> stream_;  // 最近的提交，空串表示上下文断开（退格）
+  std::unordered_map<uint64_t, Node> table_;
+  std::vector<::copilot::Entry> candidates_;
+};
+
+}  // namespace rime
@@ -2,11 +2,9 @@
 
 #include <atomic>
 #include <mutex>
+#include <vector>
 
-#ifndef __APPLE__
-#include <condition_variable>
-#include <thread>
-#endif
+#include "event_loop.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -15,9 +13,37 @@
 #include <IOKit/ps/IOPSKeys.h>
 #include <IOKit/ps/IOPowerSources.h>
 #elif __linux__
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #endif
 
+#ifdef __linux__
+namespace {
+
+constexpr const char* kPowerSupplyDir = "/sys/class/power_supply";
+
+inline std::string ReadSysfsValue(const std::filesystem::path& path) {
+  std::ifstream file(path);
+  std::string value;
+  if (file.is_open()) {
+    std::getline(file, value);
+  }
+  return value;
+}
+
+// Mains adapters show up as type "Mains"; USB-C / USB-PD chargers as "USB*".
+inline bool IsMainsType(const std::string& type) {
+  return type == "Mains" || type.compare(0, 3, "USB") == 0;
+}
+
+}  // namespace
+#endif
+
 namespace copilot {
 // Returns true if connected to AC power, false if on battery
 bool IsACPowerConnected() {
@@ -49,13 +75,22 @@ bool IsACPowerConnected() {
   return is_ac_power;
 
 #elif __linux__
-  std::ifstream file("/sys/class/power_supply/AC/online");
-  if (!file.is_open()) {
-    return false;  // Assume battery if unable to read
+  // 枚举所有电源：任一 Mains 在线即为 AC；没有电池（台式机）也视为 AC
+  std::error_code ec;
+  bool has_battery = false;
+  for (const auto& entry : std::filesystem::directory_iterator(kPowerSupplyDir, ec)) {
+    // 鼠标、键盘、耳机等外设的电池（scope=Device）不代表系统供电
+    if (ReadSysfsValue(entry.path() / "scope") == "Device") {
+      continue;
+    }
+    auto type = ReadSysfsValue(entry.path() / "type");
+    if (type == "Battery") {
+      has_battery = true;
+    } else if (IsMainsType(type) && ReadSysfsValue(entry.path() / "online") == "1") {
+      return true;
+    }
   }
-  int status = 0;
-  file >> status;
-  return status == 1;
+  return !has_battery;
 
 #else
   // Unsupported platform
@@ -79,13 +114,19 @@ class PowerMonitor {
 
   void StopMonitoring();
   void NotifyCallbacks(bool is_ac_power);
+  void CheckPowerState();
 
 #if defined(__APPLE__)
   void StartMacOSMonitor();
   static void MacOSPowerChangeCallback(void* context);
 #else
   void StartMonitoring();
-  void PollingLoop();
+  // 无事件源时退化为在共享后台线程上轮询
+  void SchedulePoll();
+#endif
+#if defined(__linux__)
+  bool StartUeventMonitor();
+  void OnUevent(int fd);
 #endif
 
   std::vector<std::function<void(bool)>> callbacks_;
@@ -95,9 +136,11 @@ class PowerMonitor {
   CFRunLoopSourceRef source_ = nullptr;
 #else
   std::atomic<bool> running_{false};
-  std::thread monitor_thread_;
-  std::condition_variable cond_;
-  std::mutex mutex_;
+  std::mutex poll_mutex_;
+  EventLoop::TaskId poll_task_ = 0;
+#endif
+#if defined(__linux__)
+  int uevent_fd_ = -1;
 #endif
 };
 
@@ -128,6 +171,14 @@ void PowerMonitor::NotifyCallbacks(bool is_ac_power) {
   }
 }
 
+void PowerMonitor::CheckPowerState() {
+  bool current_state = IsACPowerConnected();
+  if (current_state != last_power_state_) {
+    last_power_state_ = current_state;
+    NotifyCallbacks(current_state);
+  }
+}
+
 void PowerMonitor::StopMonitoring() {
 #if defined(__APPLE__)
   if (source_) {
@@ -137,32 +188,100 @@ void PowerMonitor::StopMonitoring() {
   }
 #else
   running_ = false;
-  cond_.notify_all();  // 唤醒等待的线程以便及时退出
-
-  if (monitor_thread_.joinable()) {
-    monitor_thread_.join();
+  auto& loop = EventLoop::Instance();
+  {
+    std::lock_guard<std::mutex> lock(poll_mutex_);
+    if (poll_task_) {
+      loop.Cancel(poll_task_);
+      poll_task_ = 0;
+    }
+  }
+#if defined(__linux__)
+  if (uevent_fd_ >= 0) {
+    loop.UnwatchFd(uevent_fd_);
+    close(uevent_fd_);
+    uevent_fd_ = -1;
   }
 #endif
+#endif
 }
 
 #ifndef __APPLE__
 void PowerMonitor::StartMonitoring() {
   if (running_.exchange(true)) return;
-  monitor_thread_ = std::thread(&PowerMonitor::PollingLoop, this);
+#if defined(__linux__)
+  if (StartUeventMonitor()) {
+    return;
+  }
+#endif
+  SchedulePoll();
 }
 
-void PowerMonitor::PollingLoop() {
-  while (running_) {
-    bool current_state = IsACPowerConnected();
-    if (current_state != last_power_state_) {
-      last_power_state_ = current_state;
-      NotifyCallbacks(current_state);
+void PowerMonitor::SchedulePoll() {
+  std::lock_guard<std::mutex> lock(poll_mutex_);
+  if (!running_) {
+    return;
+  }
+  poll_task_ = EventLoop::Instance().PostDelayed(std::chrono::seconds(5), [this]() {
+    CheckPowerState();
+    SchedulePoll();
+  });
+}
+#endif
+
+#if defined(__linux__)
+bool PowerMonitor::StartUeventMonitor() {
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    return false;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;  // kernel uevents
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return false;
+  }
+  uevent_fd_ = fd;
+  EventLoop::Instance().WatchFd(fd, [this](int fd) { OnUevent(fd); });
+  return true;
+}
+
+void PowerMonitor::OnUevent(int fd) {
+  // uevent: "ACTION@DEVPATH\0KEY=VALUE\0..."
+  static constexpr char kSubsystem[] = "SUBSYSTEM=power_supply";
+  static constexpr size_t kSubsystemLen = sizeof(kSubsystem) - 1;
+  char buf[4096];
+  bool relevant = false;
+  while (true) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      break;
+    }
+    bool power_supply = false;
+    bool mains = false;
+    for (ssize_t i = 0; i < n;) {
+      const char* field = buf + i;
+      size_t len = strnlen(field, n - i);
+      if (len == kSubsystemLen && memcmp(field, kSubsystem, len) == 0) {
+        power_supply = true;
+      } else if (strncmp(field, "POWER_SUPPLY_ONLINE=", 20) == 0 ||
+                 strncmp(field, "add@", 4) == 0 || strncmp(field, "remove@", 7) == 0) {
+        // 电池的周期性 change 事件不带 ONLINE 字段，直接忽略
+        mains = true;
+      }
+      i += len + 1;
     }
-    std::unique_lock<std::mutex> lock(mutex_);
-    cond_.wait_for(lock, std::chrono::seconds(5), [this]() { return !running_; });
+    relevant |= power_supply && mains;
+  }
+  if (relevant) {
+    CheckPowerState();
   }
 }
-#else
+#endif
+
+#ifdef __APPLE__
 void PowerMonitor::StartMacOSMonitor() {
   source_ = IOPSNotificationCreateRunLoopSource(MacOSPowerChangeCallback, nullptr);
   if (source_) {
@@ -170,14 +289,7 @@ void PowerMonitor::StartMacOSMonitor() {
   }
 }
 
-void PowerMonitor::MacOSPowerChangeCallback(void*) {
-  auto& instance = PowerMonitor::Instance();
-  bool current_state = IsACPowerConnected();
-  if (current_state != instance.last_power_state_) {
-    instance.last_power_state_ = current_state;
-    instance.NotifyCallbacks(current_state);
-  }
-}
+void PowerMonitor::MacOSPowerChangeCallback(void*) { PowerMonitor::Instance().CheckPowerState(); }
 #endif
 
 void RegisterPowerChange(std::function<void(bool /* is_ac_power */)> callback) {
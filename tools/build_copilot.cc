@@ -3,11 +3,168 @@
 //
 #include <rime/common.h>
 #include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <unordered_map>
 #include "copilot_db.h"
+#include "history.h"
 
 using namespace rime;
 
+namespace {
+
+struct PruneOptions {
+  double threshold = 0;  // 相对熵阈值，0 不剪枝
+  size_t max_fanout = 0;  // 每个 key 最多保留的候选数，0 不限
+  double backoff = rime::copilot::kStupidBackoff;
+};
+
+double Total(const vector<rime::copilot::RawEntry>& entries) {
+  double total = 0;
+  for (const auto& e : entries) {
+    total += e.weight;
+  }
+  return total;
+}
+
+double Backoff(const vector<rime::copilot::RawEntry>& entries, double total, double backoff) {
+  return backoff >= 0 ? backoff : entries.size() / (entries.size() + total);
+}
+
+bool ByText(const rime::copilot::RawEntry& a, const rime::copilot::RawEntry& b) {
+  return a.text < b.text;
+}
+
+// 按相对熵（Stolcke 剪枝）删除对回退模型几乎没有贡献的条目，并限制每个 key 的候选数。
+// 每个条目的贡献都相对未剪枝的模型计算；回退后找不到的条目总是保留。
+// 写入 db 时 KeyStats 的 total（及 Witten-Bell 的 alpha）按剪枝后的候选重新计算，
+// 保留下来的条目因此重新归一化，被删掉的概率质量不会留给回退
+rime::copilot::RawData Prune(rime::copilot::RawData data, const PruneOptions& options) {
+  // 候选按 text 排序以便二分查找回退概率
+  double grand_total = 0;
+  std::unordered_map<string, double> totals;
+  for (auto& [key, entries] : data) {
+    std::sort(entries.begin(), entries.end(), ByText);
+    grand_total += totals[key] = Total(entries);
+  }
+  // 去掉 key 的第一个字符后、能回退到的 text 的概率 p(w|h')；找不到时为 0。
+  // h' 中没有该 text 时再乘上 alpha(h') 回退到更短的上下文，alpha(h) 由调用方乘
+  auto backoff_prob = [&](const string& key, const rime::copilot::RawEntry& entry) {
+    double multiplier = 1;
+    for (size_t pos = ::copilot::Utf8Len(key[0]); pos < key.size();
+         pos += ::copilot::Utf8Len(key[pos])) {
+      auto it = data.find(key.substr(pos));
+      if (it == data.end()) {
+        continue;
+      }
+      const auto& entries = it->second;
+      double total = totals[it->first];
+      auto e = std::lower_bound(entries.begin(), entries.end(), entry, ByText);
+      if (e != entries.end() && e->text == entry.text && total > 0) {
+        return multiplier * e->weight / total;
+      }
+      multiplier *= Backoff(entries, total, options.backoff);
+    }
+    return 0.0;
+  };
+  rime::copilot::RawData pruned;
+  for (const auto& [key, entries] : data) {
+    double total = totals[key];
+    if (entries.empty() || total <= 0) {
+      continue;
+    }
+    double p_context = total / grand_total;
+    double alpha = Backoff(entries, total, options.backoff);
+    vector<rime::copilot::RawEntry> kept;
+    for (const auto& e : entries) {
+      if (options.threshold > 0) {
+        double p = e.weight / total;
+        double p_backoff = backoff_prob(key, e);
+        // 删掉该条目后 p(w|h) 变为 alpha * p_backoff，加权的 KL 贡献
+        if (p_backoff > 0 &&
+            p_context * p * (std::log(p) - std::log(alpha * p_backoff)) < options.threshold) {
+          continue;
+        }
+      }
+      kept.push_back(e);
+    }
+    std::stable_sort(kept.begin(), kept.end(),
+                     [](const rime::copilot::RawEntry& a, const rime::copilot::RawEntry& b) {
+                       return a.weight > b.weight;
+                     });
+    if (options.max_fanout > 0 && kept.size() > options.max_fanout) {
+      kept.resize(options.max_fanout);
+    }
+    if (!kept.empty()) {
+      pruned[key] = std::move(kept);
+    }
+  }
+  return pruned;
+}
+
+struct Coverage {
+  size_t positions = 0;
+  size_t hits = 0;
+  double rate() const { return positions ? double(hits) / positions : 0; }
+};
+
+// held-out 文本中每个位置：用最长的、存在的上下文 key 取前 top_k 个候选，
+// 命中（候选是后文的前缀）则计数
+Coverage Evaluate(const rime::copilot::RawData& data, const path& heldout, size_t max_key_chars,
+                  size_t top_k) {
+  Coverage coverage;
+  std::ifstream in(heldout);
+  string line;
+  vector<const rime::copilot::RawEntry*> top;
+  while (std::getline(in, line)) {
+    vector<size_t> starts;
+    for (size_t pos = 0; pos < line.size(); pos += ::copilot::Utf8Len(line[pos])) {
+      starts.push_back(pos);
+    }
+    for (size_t i = 1; i < starts.size(); ++i) {
+      ++coverage.positions;
+      for (size_t n = std::min(i, max_key_chars); n >= 1; --n) {
+        auto it = data.find(line.substr(starts[i - n], starts[i] - starts[i - n]));
+        if (it == data.end()) {
+          continue;
+        }
+        top.clear();
+        for (const auto& e : it->second) {
+          top.push_back(&e);
+        }
+        size_t k = std::min(top.size(), top_k);
+        std::partial_sort(top.begin(), top.begin() + k, top.end(),
+                          [](const rime::copilot::RawEntry* a, const rime::copilot::RawEntry* b) {
+                            return a->weight > b->weight;
+                          });
+        for (size_t j = 0; j < k; ++j) {
+          if (!top[j]->text.empty() && line.compare(starts[i], top[j]->text.size(),
+                                                    top[j]->text) == 0) {
+            ++coverage.hits;
+            break;
+          }
+        }
+        break;
+      }
+    }
+  }
+  return coverage;
+}
+
+size_t CountEntries(const rime::copilot::RawData& data) {
+  size_t count = 0;
+  for (const auto& [key, entries] : data) {
+    count += entries.size();
+  }
+  return count;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   rime::copilot::RawData data;
   std::string line;
@@ -35,13 +192,59 @@ int main(int argc, char* argv[]) {
   }
   */
 
-  path file_path = argc > 1 ? path(argv[1]) : path{"copilot.db"};
+  // build_copilot [--backoff=<alpha|witten_bell>] [--prune=<threshold>] [--max_fanout=<n>]
+  //               [--heldout=<text file>] [copilot.db]
+  PruneOptions prune;
+  path heldout;
+  path file_path{"copilot.db"};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = arg.substr(arg.find('=') + 1);
+    if (boost::starts_with(arg, "--backoff=")) {
+      prune.backoff = value == "witten_bell" ? rime::copilot::kWittenBell : std::stod(value);
+    } else if (boost::starts_with(arg, "--prune=")) {
+      prune.threshold = std::stod(value);
+    } else if (boost::starts_with(arg, "--max_fanout=")) {
+      prune.max_fanout = std::stoul(value);
+    } else if (boost::starts_with(arg, "--heldout=")) {
+      heldout = path(value);
+    } else {
+      file_path = path(arg);
+    }
+  }
+  double backoff = prune.backoff;
+  if (prune.threshold > 0 || prune.max_fanout > 0) {
+    size_t max_key_chars = 0;
+    for (const auto& [key, entries] : data) {
+      size_t n = 0;
+      for (size_t pos = 0; pos < key.size(); pos += ::copilot::Utf8Len(key[pos])) {
+        ++n;
+      }
+      max_key_chars = std::max(max_key_chars, n);
+    }
+    constexpr size_t kTopK = 5;
+    Coverage before;
+    if (!heldout.empty()) {
+      before = Evaluate(data, heldout, max_key_chars, kTopK);
+    }
+    size_t keys = data.size();
+    size_t entries = CountEntries(data);
+    data = Prune(std::move(data), prune);
+    std::cerr << "keys: " << keys << " -> " << data.size() << ", entries: " << entries << " -> "
+              << CountEntries(data) << std::endl;
+    if (!heldout.empty()) {
+      auto after = Evaluate(data, heldout, max_key_chars, kTopK);
+      std::cerr << "heldout top-" << kTopK << " coverage (" << before.positions
+                << " positions): " << before.rate() << " -> " << after.rate() << std::endl;
+    }
+  }
   CopilotDb db(file_path);
-  LOG(INFO) << "creating " << db.file_path();
-  if (!db.Build(data) || !db.Save()) {
+  LOG(INFO) << "creating " << db.file_path() << ", backoff: " << backoff;
+  if (!db.Build(data, backoff) || !db.Save()) {
     LOG(ERROR) << "failed to build " << db.file_path();
     return 1;
   }
   LOG(INFO) << "created: " << db.file_path();
+  std::cerr << "db size: " << std::filesystem::file_size(db.file_path()) << " bytes" << std::endl;
   return 0;
 }
@@ -0,0 +1,326 @@
+//
+// Copyright RIME Developers
+//
+// 离线评估：把语料逐行当作文档输入，模拟提交并统计命中率、节省的字数和预测延迟。
+//
+// copilot_eval --db=copilot.db [--db=domain.db:2.0] [options] < corpus.txt
+//
+#include <rime/common.h>
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include "copilot_db.h"
+#include "copilot_engine.h"
+#include "db_provider.h"
+#include "history.h"
+#include "llm_provider.h"
+#include "session_provider.h"
+
+using namespace rime;
+
+namespace {
+
+struct Options {
+  std::vector<std::pair<string, double>> dbs;
+  DBProvider::Config db;
+  bool session = false;
+  SessionProvider::Config session_config;
+  string llm_model;
+  LLMProvider::Config llm;
+  int top_k = 5;
+  int threads = 0;
+  size_t batch_lines = 256;
+};
+
+struct Stats {
+  uint64_t documents = 0;
+  uint64_t chars = 0;        // 语料总字数
+  uint64_t predictions = 0;  // 给出候选的提交次数
+  uint64_t top1 = 0;
+  uint64_t top_k = 0;
+  uint64_t saved = 0;  // 采纳候选省下的字数（扣除选择的一次按键）
+  std::vector<double> latency_us;
+
+  void Merge(Stats&& other) {
+    documents += other.documents;
+    chars += other.chars;
+    predictions += other.predictions;
+    top1 += other.top1;
+    top_k += other.top_k;
+    saved += other.saved;
+    latency_us.insert(latency_us.end(), other.latency_us.begin(), other.latency_us.end());
+  }
+};
+
+// 文档按行分批，由读取线程放入队列，各 worker 取走处理
+class BatchQueue {
+ public:
+  explicit BatchQueue(size_t capacity) : capacity_(capacity) {}
+
+  void Push(std::vector<string>&& batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return batches_.size() < capacity_; });
+    batches_.push(std::move(batch));
+    not_empty_.notify_one();
+  }
+  bool Pop(std::vector<string>* batch) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return !batches_.empty() || closed_; });
+    if (batches_.empty()) {
+      return false;
+    }
+    *batch = std::move(batches_.front());
+    batches_.pop();
+    not_full_.notify_one();
+    return true;
+  }
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::queue<std::vector<string>> batches_;
+  bool closed_ = false;
+};
+
+// 每个 worker 有自己的 History 和 provider；DB 各自打开，只读 mmap 的页缓存仍然共享
+class Worker {
+ public:
+  explicit Worker(const Options& options) : options_(options) {
+    history_ = std::make_shared<::copilot::History>(100);
+    std::vector<std::shared_ptr<Provider>> providers;
+    std::shared_ptr<LLMProvider> llm;
+    if (!options.llm_model.empty()) {
+      auto config = options.llm;
+      config.model = options.llm_model;
+      llm = std::make_shared<LLMProvider>(config, history_);
+      providers.push_back(llm);
+    }
+    std::vector<DBProvider::Layer> layers;
+    for (const auto& [file, weight] : options.dbs) {
+      auto db = std::make_shared<CopilotDb>(path(file));
+      if (db->Load()) {
+        layers.push_back({db, weight});
+      } else {
+        LOG(ERROR) << "failed to load copilot db: " << file;
+      }
+    }
+    if (!layers.empty()) {
+      if (llm) {
+        llm->set_db(layers.front().db);
+      }
+      providers.push_back(std::make_shared<DBProvider>(std::move(layers), history_, options.db));
+    }
+    if (options.session) {
+      providers.push_back(std::make_shared<SessionProvider>(options.session_config));
+    }
+    engine_ = std::make_unique<CopilotEngine>(providers, history_, 0);
+  }
+
+  void Run(const string& document) {
+    ++stats_.documents;
+    engine_->BackSpace();  // 新文档：清空历史与上下文
+    const std::string& line = document;
+    ::copilot::UTF8 chars(line);
+    const int n = chars.size();
+    stats_.chars += n;
+    string commit;
+    for (int i = 0; i < n;) {
+      if (commit.empty()) {
+        commit = string(chars[i++]);
+      }
+      history_->add(commit);
+      if (::copilot::IsPunct(commit)) {
+        engine_->Clear();
+        commit.clear();
+        continue;
+      }
+      auto start = std::chrono::steady_clock::now();
+      bool predicted = engine_->Copilot(nullptr, commit);
+      const auto& candidates = predicted ? engine_->candidates() : kEmpty;
+      stats_.latency_us.push_back(std::chrono::duration<double, std::micro>(
+                                      std::chrono::steady_clock::now() - start)
+                                      .count());
+      commit.clear();
+      if (candidates.empty() || i >= n) {
+        continue;
+      }
+      ++stats_.predictions;
+      auto rest = std::string_view(line).substr(chars(i, i).data() - line.data());
+      int limit = std::min<int>(candidates.size(), options_.top_k);
+      for (int r = 0; r < limit; ++r) {
+        const auto& text = candidates[r].text;
+        if (text.empty() || !boost::starts_with(rest, text)) {
+          continue;
+        }
+        // 采纳：把候选当作下一次提交
+        int length = ::copilot::UTF8(text).size();
+        stats_.top1 += r == 0;
+        ++stats_.top_k;
+        stats_.saved += length - 1;
+        commit = text;
+        i += length;
+        break;
+      }
+    }
+  }
+
+  Stats TakeStats() { return std::move(stats_); }
+
+ private:
+  static const std::vector<::copilot::Entry> kEmpty;
+  const Options& options_;
+  std::shared_ptr<::copilot::History> history_;
+  std::unique_ptr<CopilotEngine> engine_;
+  Stats stats_;
+};
+
+const std::vector<::copilot::Entry> Worker::kEmpty;
+
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void Usage() {
+  std::cerr << "usage: copilot_eval --db=<file>[:<weight>] ... [options] < corpus.txt\n"
+               "  --max_candidates=<n> --max_hints=<n> --beam_width=<n> --beam_depth=<n>\n"
+               "  --session[=<order>]           enable the session n-gram provider\n"
+               "  --llm=<model.gguf>            enable the LLM provider (loaded per worker)\n"
+               "  --n_predict=<n> --llm_rank=<n>\n"
+               "  --top_k=<n>                   candidates counted as a hit (default 5)\n"
+               "  --threads=<n>                 worker threads (default: hardware concurrency,\n"
+               "                                1 with --llm)\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      auto eq = arg.find('=');
+      auto name = arg.substr(0, eq);
+      auto value = eq == string::npos ? string() : arg.substr(eq + 1);
+      if (name == "--db") {
+        auto colon = value.rfind(':');
+        if (colon != string::npos) {
+          options.dbs.push_back({value.substr(0, colon), std::stod(value.substr(colon + 1))});
+        } else {
+          options.dbs.push_back({value, 1.0});
+        }
+      } else if (name == "--max_candidates") {
+        options.db.max_candidates = std::stoi(value);
+      } else if (name == "--max_hints") {
+        options.db.max_hints = std::stoi(value);
+      } else if (name == "--beam_width") {
+        options.db.beam_width = std::stoi(value);
+      } else if (name == "--beam_depth") {
+        options.db.beam_depth = std::stoi(value);
+      } else if (name == "--session") {
+        options.session = true;
+        if (!value.empty()) {
+          options.session_config.order = std::stoi(value);
+        }
+      } else if (name == "--llm") {
+        options.llm_model = value;
+      } else if (name == "--n_predict") {
+        options.llm.n_predict = std::stoi(value);
+      } else if (name == "--llm_rank") {
+        options.llm.rank = std::stoi(value);
+      } else if (name == "--top_k") {
+        options.top_k = std::max(1, std::stoi(value));
+      } else if (name == "--threads") {
+        options.threads = std::stoi(value);
+      } else {
+        Usage();
+        return 1;
+      }
+    }
+  } catch (const std::logic_error&) {  // std::stoi / std::stod 的 invalid_argument / out_of_range
+    Usage();
+    return 1;
+  }
+  if (options.dbs.empty() && options.llm_model.empty() && !options.session) {
+    Usage();
+    return 1;
+  }
+  if (options.threads <= 0) {
+    // 每个 worker 各自加载一份模型，启用 LLM 时默认只用一个线程
+    options.threads =
+        options.llm_model.empty() ? std::max(1u, std::thread::hardware_concurrency()) : 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  BatchQueue queue(options.threads * 4);
+  std::mutex stats_mutex;
+  Stats total;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < options.threads; ++t) {
+    workers.emplace_back([&] {
+      Worker worker(options);
+      std::vector<string> batch;
+      while (queue.Pop(&batch)) {
+        for (const auto& document : batch) {
+          worker.Run(document);
+        }
+      }
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      total.Merge(worker.TakeStats());
+    });
+  }
+  std::vector<string> batch;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    batch.push_back(std::move(line));
+    if (batch.size() >= options.batch_lines) {
+      queue.Push(std::move(batch));
+      batch.clear();
+    }
+  }
+  if (!batch.empty()) {
+    queue.Push(std::move(batch));
+  }
+  queue.Close();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  auto& latency = total.latency_us;
+  std::sort(latency.begin(), latency.end());
+  auto rate = [](uint64_t a, uint64_t b) { return b ? 100.0 * a / b : 0.0; };
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "documents:   " << total.documents << " (" << total.chars << " chars, "
+            << options.threads << " threads, " << seconds << " s)\n";
+  std::cout << "predictions: " << total.predictions << "\n";
+  std::cout << "top-1 hit:   " << rate(total.top1, total.predictions) << "%\n";
+  std::cout << "top-" << options.top_k << " hit:   " << rate(total.top_k, total.predictions)
+            << "%\n";
+  std::cout << "chars saved: " << total.saved << " (" << rate(total.saved, total.chars) << "%)\n";
+  std::cout << "latency us:  p50 " << Percentile(latency, 0.5) << ", p90 "
+            << Percentile(latency, 0.9) << ", p99 " << Percentile(latency, 0.99) << ", max "
+            << (latency.empty() ? 0 : latency.back()) << "\n";
+  return 0;
+}